@@ -31,17 +31,28 @@
  */
 
 #include <errno.h>
+#include <libgen.h>
 #include <setjmp.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif /* __linux__ */
 
 #ifndef __vax__
 #include <fenv.h>
+#if !defined(__GNUC__) || defined(__clang__)
 #pragma STDC FENV_ACCESS ON
+#endif /* ! __GNUC__ || __clang__ */
 #endif /* __vax__ */
 
 #include "../tbvm/tbvm.h"
@@ -247,11 +258,589 @@ static const struct tbvm_exc_io jttb_exc_io = {
 	.io_math_exc = jttb_math_exc,
 };
 
+/*
+ * Tracing support.  Trace events are written in the Chrome / Perfetto
+ * "trace event" JSON format.  Each BASIC line executed gets its own
+ * span, GOSUBs get a span that encloses the lines executed by the
+ * subroutine, and string GCs and array allocations are recorded as
+ * instant events.
+ */
+static FILE *trace_file;
+static bool trace_line_open;
+static struct timespec trace_epoch;
+
+static unsigned long long
+trace_timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)(ts.tv_sec - trace_epoch.tv_sec) * 1000000 +
+	    (ts.tv_nsec - trace_epoch.tv_nsec) / 1000;
+}
+
+static void
+trace_event(const char *name, const char *cat, char ph)
+{
+	fprintf(trace_file,
+	    ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+	    "\"ts\":%llu,\"pid\":1,\"tid\":1}",
+	    name, cat, ph, trace_timestamp());
+}
+
+static void
+trace_close_line(void)
+{
+	if (trace_line_open) {
+		trace_event("", "line", 'E');
+		trace_line_open = false;
+	}
+}
+
+static void
+jttb_trace_line(void *vctx, int lineno)
+{
+	char name[32];
+
+	trace_close_line();
+	snprintf(name, sizeof(name), "LINE %d", lineno);
+	trace_event(name, "line", 'B');
+	trace_line_open = true;
+}
+
+static void
+jttb_trace_direct(void *vctx)
+{
+	trace_close_line();
+}
+
+static void
+jttb_trace_gosub(void *vctx, int lineno)
+{
+	char name[32];
+
+	trace_close_line();
+	snprintf(name, sizeof(name), "GOSUB FROM %d", lineno);
+	trace_event(name, "gosub", 'B');
+}
+
+static void
+jttb_trace_return(void *vctx)
+{
+	trace_close_line();
+	trace_event("", "gosub", 'E');
+}
+
+static void
+jttb_trace_gc(void *vctx, unsigned int nfreed)
+{
+	fprintf(trace_file,
+	    ",\n{\"name\":\"string GC\",\"cat\":\"gc\",\"ph\":\"i\","
+	    "\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":1,"
+	    "\"args\":{\"freed\":%u}}",
+	    trace_timestamp(), nfreed);
+}
+
+static void
+jttb_trace_array(void *vctx, const char *name, int nelem)
+{
+	fprintf(trace_file,
+	    ",\n{\"name\":\"array %s\",\"cat\":\"alloc\",\"ph\":\"i\","
+	    "\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":1,"
+	    "\"args\":{\"elements\":%d}}",
+	    name, trace_timestamp(), nelem);
+}
+
+static const struct tbvm_trace_io jttb_trace_io = {
+	.io_trace_line = jttb_trace_line,
+	.io_trace_direct = jttb_trace_direct,
+	.io_trace_gosub = jttb_trace_gosub,
+	.io_trace_return = jttb_trace_return,
+	.io_trace_gc = jttb_trace_gc,
+	.io_trace_array = jttb_trace_array,
+};
+
+static bool
+trace_init(const char *fname)
+{
+	trace_file = fopen(fname, "w");
+	if (trace_file == NULL) {
+		return false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+	fprintf(trace_file,
+	    "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+	    "\"args\":{\"name\":\"jttb\"}}");
+	return true;
+}
+
+static void
+trace_fini(void)
+{
+	trace_close_line();
+	fprintf(trace_file, "\n]\n");
+	fclose(trace_file);
+}
+
+/*
+ * Sampling profiler support.  A CPU-time interval timer periodically
+ * interrupts the VM, and the signal handler records a sample of what
+ * the VM is doing at that moment.
+ */
+#define	PROFILE_HZ	997		/* avoid aliasing with periodic work */
+
+static void
+sigprof_handler(int sig)
+{
+	tbvm_profile_sample(vm);
+}
+
+static bool
+profile_init(void)
+{
+	struct sigaction sa;
+	struct itimerval itv = {
+		.it_interval = {
+			.tv_usec = 1000000 / PROFILE_HZ,
+		},
+		.it_value = {
+			.tv_usec = 1000000 / PROFILE_HZ,
+		},
+	};
+
+	if (! tbvm_profile_start(vm)) {
+		return false;
+	}
+
+	sa.sa_handler = sigprof_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGPROF, &sa, NULL) != 0) {
+		return false;
+	}
+	return setitimer(ITIMER_PROF, &itv, NULL) == 0;
+}
+
+static bool
+profile_fini(const char *fname)
+{
+	struct itimerval itv = { 0 };
+	FILE *fp;
+
+	setitimer(ITIMER_PROF, &itv, NULL);
+	signal(SIGPROF, SIG_IGN);
+
+	fp = fopen(fname, "w");
+	if (fp == NULL) {
+		return false;
+	}
+	tbvm_profile_dump(vm, fp);
+	fclose(fp);
+	return true;
+}
+
+/*
+ * Hardware performance counter support.  The counters are opened as
+ * a single group so that they can all be read with one system call,
+ * and the VM brackets one out of every PERF_PERIOD instructions with
+ * reads of the group.
+ */
+#define	PERF_PERIOD	17		/* avoid aliasing with IL loops */
+
+#ifdef __linux__
+static int perf_fds[TBVM_PERF_NCOUNTERS] = { -1, -1, -1, -1 };
+
+static const struct {
+	unsigned int		type;
+	unsigned long long	config;
+} perf_events[TBVM_PERF_NCOUNTERS] = {
+	[TBVM_PERF_CYCLES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES
+	},
+	[TBVM_PERF_INSNS] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS
+	},
+	[TBVM_PERF_BRANCH_MISSES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES
+	},
+	[TBVM_PERF_CACHE_MISSES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES
+	},
+};
+
+static bool
+jttb_perf_read(void *vctx, unsigned long long *vals)
+{
+	/* PERF_FORMAT_GROUP: nr, followed by one value per counter. */
+	unsigned long long buf[1 + TBVM_PERF_NCOUNTERS];
+	int i;
+
+	if (read(perf_fds[0], buf, sizeof(buf)) != sizeof(buf) ||
+	    buf[0] != TBVM_PERF_NCOUNTERS) {
+		return false;
+	}
+	for (i = 0; i < TBVM_PERF_NCOUNTERS; i++) {
+		vals[i] = buf[1 + i];
+	}
+	return true;
+}
+
+static const struct tbvm_perf_io jttb_perf_io = {
+	.io_perf_read = jttb_perf_read,
+};
+
+static bool
+perf_init(void)
+{
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < TBVM_PERF_NCOUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+		    i == 0 ? -1 : perf_fds[0], 0);
+		if (perf_fds[i] == -1) {
+			return false;
+		}
+	}
+	return tbvm_set_perf_io(vm, &jttb_perf_io, PERF_PERIOD);
+}
+
+static void
+perf_close(void)
+{
+	int i;
+
+	for (i = TBVM_PERF_NCOUNTERS - 1; i >= 0; i--) {
+		if (perf_fds[i] != -1) {
+			close(perf_fds[i]);
+			perf_fds[i] = -1;
+		}
+	}
+}
+#else
+static bool
+perf_init(void)
+{
+	errno = ENOTSUP;
+	return false;
+}
+
+static void
+perf_close(void)
+{
+}
+#endif /* __linux__ */
+
+static bool
+perf_fini(const char *fname)
+{
+	FILE *fp;
+
+	perf_close();
+
+	fp = fopen(fname, "w");
+	if (fp == NULL) {
+		return false;
+	}
+	tbvm_perf_dump(vm, fp);
+	fclose(fp);
+	return true;
+}
+
+/*
+ * IL coverage support.  The VM counts executions of each instruction
+ * address.  Given the address map generated by "tbasm -m", the counts
+ * are written as an annotated listing of the VM program source, in the
+ * style of gcov: "-" for lines with no instruction, "#####" for
+ * instructions that never ran.  Otherwise, the raw counts are written
+ * as "address count" pairs.
+ */
+#define	COVERAGE_NHOT	20
+
+struct coverage_hot {
+	unsigned long	count;
+	unsigned int	addr;
+	int		lineno;
+	char		src[56];
+};
+
+static bool
+coverage_raw(FILE *fp, const unsigned long *cov, size_t covsize)
+{
+	size_t addr;
+
+	for (addr = 0; addr < covsize; addr++) {
+		if (cov[addr] != 0) {
+			fprintf(fp, "%zu %lu\n", addr, cov[addr]);
+		}
+	}
+	return true;
+}
+
+static bool
+coverage_annotate(FILE *fp, FILE *mapfp, const unsigned long *cov,
+    size_t covsize)
+{
+	struct coverage_hot hot[COVERAGE_NHOT];
+	unsigned long total = 0;
+	unsigned int ninsns = 0, nrun = 0;
+	char buf[1024], *src, *ep;
+	unsigned long addr;
+	int i, j, nhot = 0, lineno = 0;
+
+	while (fgets(buf, sizeof(buf), mapfp) != NULL) {
+		if (buf[0] == '#') {
+			continue;
+		}
+		lineno++;
+		if ((src = strchr(buf, '\t')) == NULL) {
+			errno = EINVAL;
+			return false;
+		}
+		src++;
+		if (buf[0] == '-') {
+			fprintf(fp, "%9s:%6s:%5d:%s", "-", "", lineno, src);
+			continue;
+		}
+		addr = strtoul(buf, &ep, 10);
+		if (*ep != '\t' || addr >= covsize) {
+			errno = EINVAL;
+			return false;
+		}
+		ninsns++;
+		if (cov[addr] == 0) {
+			fprintf(fp, "%9s:%6lu:%5d:%s", "#####", addr, lineno,
+			    src);
+			continue;
+		}
+		nrun++;
+		total += cov[addr];
+		fprintf(fp, "%9lu:%6lu:%5d:%s", cov[addr], addr, lineno, src);
+
+		/* Keep the hottest instructions, most executed first. */
+		for (i = 0; i < nhot && hot[i].count >= cov[addr]; i++) {
+			continue;
+		}
+		if (i < COVERAGE_NHOT) {
+			if (nhot < COVERAGE_NHOT) {
+				nhot++;
+			}
+			for (j = nhot - 1; j > i; j--) {
+				hot[j] = hot[j - 1];
+			}
+			hot[i].count = cov[addr];
+			hot[i].addr = (unsigned int)addr;
+			hot[i].lineno = lineno;
+			snprintf(hot[i].src, sizeof(hot[i].src), "%.*s",
+			    (int)strcspn(src, "\n"), src);
+		}
+	}
+
+	fprintf(fp, "\n# %u of %u IL instructions executed (%.1f%%), "
+	    "%lu executions\n",
+	    nrun, ninsns, ninsns ? (100.0 * nrun) / ninsns : 0.0, total);
+	fprintf(fp, "\n# Hottest instructions\n");
+	for (i = 0; i < nhot; i++) {
+		fprintf(fp, "%9lu:%6u:%5d:%s\n", hot[i].count, hot[i].addr,
+		    hot[i].lineno, hot[i].src);
+	}
+	return ferror(fp) == 0 && ferror(mapfp) == 0;
+}
+
+static bool
+coverage_fini(const char *fname, const char *mapfname)
+{
+	const unsigned long *cov;
+	size_t covsize;
+	FILE *fp, *mapfp = NULL;
+	bool rv;
+
+	cov = tbvm_coverage(vm, &covsize);
+
+	if (mapfname != NULL && (mapfp = fopen(mapfname, "r")) == NULL) {
+		return false;
+	}
+	if ((fp = fopen(fname, "w")) == NULL) {
+		if (mapfp != NULL) {
+			fclose(mapfp);
+		}
+		return false;
+	}
+	if (mapfp != NULL) {
+		rv = coverage_annotate(fp, mapfp, cov, covsize);
+		fclose(mapfp);
+	} else {
+		rv = coverage_raw(fp, cov, covsize);
+	}
+	fclose(fp);
+	return rv;
+}
+
+/*
+ * Resource limits, specified as "-L name=value".
+ */
+static const struct {
+	const char	*name;
+	size_t		offset;
+} limit_names[] = {
+	{ "insns",	offsetof(struct tbvm_limits, max_insns) },
+	{ "strings",	offsetof(struct tbvm_limits, max_string_bytes) },
+	{ "arrays",	offsetof(struct tbvm_limits, max_array_elems) },
+	{ "seconds",	offsetof(struct tbvm_limits, max_seconds) },
+};
+
+static bool
+limit_parse(struct tbvm_limits *limits, const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	unsigned long val;
+	char *ep;
+	size_t i;
+
+	if (eq == NULL || eq[1] == '\0') {
+		return false;
+	}
+	errno = 0;
+	val = strtoul(eq + 1, &ep, 0);
+	if (*ep != '\0' || errno != 0) {
+		return false;
+	}
+	for (i = 0; i < sizeof(limit_names) / sizeof(limit_names[0]); i++) {
+		if (strlen(limit_names[i].name) == (size_t)(eq - arg) &&
+		    strncmp(limit_names[i].name, arg, eq - arg) == 0) {
+			*(unsigned long *)((char *)limits +
+			    limit_names[i].offset) = val;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Load a VM program image written by "tbasm -o".  The VM makes its
+ * own copy of the program, so the image is freed once it's loaded.
+ */
+static bool
+prog_load(const char *fname)
+{
+	char *prog = NULL;
+	long size;
+	FILE *fp;
+
+	if ((fp = fopen(fname, "rb")) == NULL) {
+		fprintf(stderr, "unable to open VM program '%s': %s\n",
+		    fname, strerror(errno));
+		return false;
+	}
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET) != 0 ||
+	    (prog = malloc(size == 0 ? 1 : (size_t)size)) == NULL ||
+	    fread(prog, 1, (size_t)size, fp) != (size_t)size) {
+		fprintf(stderr, "unable to read VM program '%s': %s\n",
+		    fname, strerror(errno));
+		goto bad;
+	}
+	if (! tbvm_set_prog(vm, prog, (size_t)size)) {
+		fprintf(stderr, "invalid VM program '%s': %s\n",
+		    fname, tbvm_prog_error(vm));
+		goto bad;
+	}
+	free(prog);
+	fclose(fp);
+	return true;
+
+ bad:
+	free(prog);
+	fclose(fp);
+	return false;
+}
+
+static char *myprogname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-C coverage.txt [-M tbvm_program.map]] "
+	    "[-H counters.txt]\n"
+	    "       [-L insns|strings|arrays|seconds=value] [-P program.bin] "
+	    "[-S profile.folded]\n"
+	    "       [-T trace.json]\n", myprogname);
+	exit(1);
+}
+
 int
 main(int argc, char *argv[])
 {
 	struct sigaction sa;
 	sigset_t nset;
+	char *trace_fname = NULL;
+	char *profile_fname = NULL;
+	char *perf_fname = NULL;
+	char *cov_fname = NULL;
+	char *map_fname = NULL;
+	char *prog_fname = NULL;
+	struct tbvm_limits limits = { 0 };
+	bool lflag = false;
+	int ch, rv;
+
+	myprogname = strdup(basename(argv[0]));
+
+	while ((ch = getopt(argc, argv, "C:H:L:M:P:S:T:")) != -1) {
+		switch (ch) {
+		case 'C':
+			cov_fname = optarg;
+			break;
+
+		case 'H':
+			perf_fname = optarg;
+			break;
+
+		case 'L':
+			if (! limit_parse(&limits, optarg)) {
+				usage();
+			}
+			lflag = true;
+			break;
+
+		case 'M':
+			map_fname = optarg;
+			break;
+
+		case 'P':
+			prog_fname = optarg;
+			break;
+
+		case 'S':
+			profile_fname = optarg;
+			break;
+
+		case 'T':
+			trace_fname = optarg;
+			break;
+
+		default:
+			usage();
+		}
+	}
+	argv += optind;
+	argc -= optind;
+
+	if (argc != 0 || (map_fname != NULL && cov_fname == NULL)) {
+		usage();
+	}
+
+	if (trace_fname != NULL && ! trace_init(trace_fname)) {
+		fprintf(stderr, "unable to open trace file '%s': %s\n",
+		    trace_fname, strerror(errno));
+		exit(1);
+	}
 
 	printf("%s, version %s\n", tbvm_name(), tbvm_version());
 
@@ -273,11 +862,56 @@ main(int argc, char *argv[])
 	sigaction(SIGFPE, &sa, NULL);
 
 	vm = tbvm_alloc(NULL);
+	if (prog_fname != NULL && ! prog_load(prog_fname)) {
+		exit(1);
+	}
 	tbvm_set_file_io(vm, &jttb_file_io);
 	tbvm_set_time_io(vm, &jttb_time_io);
 	tbvm_set_exc_io(vm, &jttb_exc_io);
+	if (trace_file != NULL) {
+		tbvm_set_trace_io(vm, &jttb_trace_io);
+	}
+	if (lflag) {
+		tbvm_set_limits(vm, &limits);
+	}
+	if (profile_fname != NULL && ! profile_init()) {
+		fprintf(stderr, "unable to start profiler: %s\n",
+		    strerror(errno));
+		exit(1);
+	}
+	if (cov_fname != NULL && ! tbvm_coverage_start(vm)) {
+		fprintf(stderr, "unable to start coverage: %s\n",
+		    strerror(errno));
+		exit(1);
+	}
+	if (perf_fname != NULL && ! perf_init()) {
+		/* ENOENT means the kernel knows of no such counter. */
+		fprintf(stderr,
+		    "hardware performance counters unavailable: %s\n",
+		    errno == ENOENT ? "not supported by this CPU"
+				    : strerror(errno));
+		perf_close();
+		perf_fname = NULL;
+	}
 	tbvm_exec(vm);
+	if (perf_fname != NULL && ! perf_fini(perf_fname)) {
+		fprintf(stderr, "unable to write counters '%s': %s\n",
+		    perf_fname, strerror(errno));
+	}
+	if (cov_fname != NULL && ! coverage_fini(cov_fname, map_fname)) {
+		fprintf(stderr, "unable to write coverage '%s': %s\n",
+		    cov_fname, strerror(errno));
+	}
+	if (profile_fname != NULL && ! profile_fini(profile_fname)) {
+		fprintf(stderr, "unable to write profile '%s': %s\n",
+		    profile_fname, strerror(errno));
+	}
+	rv = tbvm_limit_status(vm) == TBVM_LIMIT_NONE ? 0 : 2;
 	tbvm_free(vm);
 
-	return 0;
+	if (trace_file != NULL) {
+		trace_fini();
+	}
+
+	return rv;
 }
@@ -36,7 +36,7 @@
  *
  * - While the original articles suggest relative labels to keep the
  *   VM byte code more compact, this implementation currently uses
- *   16-bit absolute labels.
+ *   16-bit absolute labels (32-bit with -L 4).
  *
  * - This implementation uses 1 byte unsigned literals.
  *
@@ -44,8 +44,10 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <libgen.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -73,13 +75,31 @@ dbg_printf(const char *fmt, ...)
 
 struct label {
 	struct label *next;
+	struct label *hash_next;
+	struct prognode *decl;	/* declaration node */
 	char *string;
+	size_t len;
+	unsigned int hash;
 	int addr;
 	int resolved;		/* line number where declared */
+	int refs;		/* used by the optimizer */
+	struct prognode **xrefs; /* used by the listing */
+	int nxrefs;
 };
 
 static struct label *labels;
 
+/*
+ * Labels are also entered into a hash table so that looking one up
+ * doesn't get slower as the program grows.  The table doubles in
+ * size whenever the average chain length would exceed 1.
+ */
+#define	LABEL_HASH_INITIAL	64
+
+static struct label **label_hash;
+static unsigned int label_hash_size;	/* always a power of 2 */
+static unsigned int label_hash_count;
+
 /*
  * There are two special labels that every TBVM program must have:
  *
@@ -100,22 +120,22 @@ struct opcode {
 const struct opcode opcode_tab[] = {
 	{ "TST",	OPC_TST,	OPC_F_LABEL | OPC_F_STRING },
 	{ "CALL",	OPC_CALL,	OPC_F_LABEL },
-	{ "RTN",	OPC_RTN,	0 },
+	{ "RTN",	OPC_RTN,	OPC_F_TERM },
 	{ "DONE",	OPC_DONE,	0 },
-	{ "JMP",	OPC_JMP,	OPC_F_LABEL },
+	{ "JMP",	OPC_JMP,	OPC_F_LABEL | OPC_F_TERM },
 	{ "PRS",	OPC_PRS,	0 },
 	{ "PRN",	OPC_PRN,	0 },
 	{ "SPC",	OPC_SPC,	0 },
 	{ "NLINE",	OPC_NLINE,	0 },
-	{ "NXT",	OPC_NXT,	0 },
-	{ "XFER",	OPC_XFER,	0 },
+	{ "NXT",	OPC_NXT,	OPC_F_TERM },
+	{ "XFER",	OPC_XFER,	OPC_F_TERM },
 	{ "SAV",	OPC_SAV,	0 },
 	{ "RSTR",	OPC_RSTR,	0 },
 	{ "CMPR",	OPC_CMPR,	0 },
 	{ "LIT",	OPC_LIT,	OPC_F_NUMBER },
 	{ "INNUM",	OPC_INNUM,	0 },
-	{ "FIN",	OPC_FIN,	0 },
-	{ "ERR",	OPC_ERR,	0 },
+	{ "FIN",	OPC_FIN,	OPC_F_TERM },
+	{ "ERR",	OPC_ERR,	OPC_F_TERM },
 	{ "ADD",	OPC_ADD,	0 },
 	{ "SUB",	OPC_SUB,	0 },
 	{ "NEG",	OPC_NEG,	0 },
@@ -133,12 +153,12 @@ const struct opcode opcode_tab[] = {
 	{ "XINIT",	OPC_XINIT,	0 },
 
 	/* JTTB additions */
-	{ "RUN",	OPC_RUN,	0 },
+	{ "RUN",	OPC_RUN,	OPC_F_TERM },
 	{ "EXIT",	OPC_EXIT,	0 },
 	{ "CMPRX",	OPC_CMPRX,	OPC_F_LABEL },
 	{ "FOR",	OPC_FOR,	0 },
 	{ "STEP",	OPC_STEP,	0 },
-	{ "NXTFOR",	OPC_NXTFOR,	0 },
+	{ "NXTFOR",	OPC_NXTFOR,	OPC_F_TERM },
 	{ "MOD",	OPC_MOD,	0 },
 	{ "POW",	OPC_POW,	0 },
 	{ "RND",	OPC_RND,	0 },
@@ -160,8 +180,8 @@ const struct opcode opcode_tab[] = {
 	{ "ADVEOL",	OPC_ADVEOL,	0 },
 	{ "INVAR",	OPC_INVAR,	0 },
 	{ "POP",	OPC_POP,	0 },
-	{ "LDPRG",	OPC_LDPRG,	0 },
-	{ "SVPRG",	OPC_SVPRG,	0 },
+	{ "LDPRG",	OPC_LDPRG,	OPC_F_TERM },
+	{ "SVPRG",	OPC_SVPRG,	OPC_F_TERM },
 	{ "DONEM",	OPC_DONEM,	OPC_F_NUMBER },
 	{ "SRND",	OPC_SRND,	0 },
 	{ "FLR",	OPC_FLR,	0 },
@@ -184,6 +204,15 @@ const struct opcode opcode_tab[] = {
 	{ "ADVCRS",	OPC_ADVCRS,	OPC_F_NUMBER },
 	{ "DEGRAD",	OPC_DEGRAD,	OPC_F_NUMBER },
 	{ "UPRLWR",	OPC_UPRLWR,	OPC_F_NUMBER },
+	{ "MEMO",	OPC_MEMO,	0 },
+	{ "CEXPR",	OPC_CEXPR,	0 },
+	{ "DREAD",	OPC_DREAD,	0 },
+	{ "DSEEK",	OPC_DSEEK,	0 },
+	{ "INSTR",	OPC_INSTR,	0 },
+	{ "HGET",	OPC_HGET,	OPC_F_NUMBER },
+	{ "HSET",	OPC_HSET,	0 },
+	{ "HDEL",	OPC_HDEL,	OPC_F_NUMBER },
+	{ "HINFO",	OPC_HINFO,	OPC_F_NUMBER },
 
 	{ NULL,		0,		0 },
 };
@@ -199,6 +228,13 @@ struct prognode {
 	int addr;
 	int size;
 	int lineno;
+	struct prognode *prev;	/* used by the optimizer */
+	bool reachable;
+	unsigned int stk_idx;	/* used by the stack checker */
+	struct stk_routine *stk_routine;
+	bool stk_reached;
+	bool stk_unproven;
+	int tst_depth;		/* used by the listing */
 };
 
 static struct prognode *program_head;
@@ -207,6 +243,7 @@ static unsigned int current_pc;		/* also program size */
 static unsigned int insn_count;
 static unsigned int label_count;
 static unsigned int labelref_count;
+static unsigned int label_size = OPC_LBL_SIZE;
 
 struct parser {
 	const char *cursor;
@@ -447,34 +484,93 @@ get_number(struct parser * const parser)
 	parser->number = number;
 }
 
+/* FNV-1a */
+static unsigned int
+label_hash_string(const char *cp, size_t len)
+{
+	unsigned int hash = 2166136261u;
+
+	while (len-- != 0) {
+		hash ^= (unsigned char)*cp++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void
+label_hash_insert(struct label *l)
+{
+	struct label **new_hash, *ol, *next;
+	unsigned int i, j, new_size;
+
+	if (label_hash_count >= label_hash_size) {
+		new_size = label_hash_size == 0 ? LABEL_HASH_INITIAL
+						: label_hash_size * 2;
+		new_hash = calloc(new_size, sizeof(*new_hash));
+		for (i = 0; i < label_hash_size; i++) {
+			for (ol = label_hash[i]; ol != NULL; ol = next) {
+				next = ol->hash_next;
+				j = ol->hash & (new_size - 1);
+				ol->hash_next = new_hash[j];
+				new_hash[j] = ol;
+			}
+		}
+		free(label_hash);
+		label_hash = new_hash;
+		label_hash_size = new_size;
+	}
+
+	i = l->hash & (label_hash_size - 1);
+	l->hash_next = label_hash[i];
+	label_hash[i] = l;
+	label_hash_count++;
+}
+
 static struct label *
-gen_label(struct parser * const parser, struct prognode *node)
+label_hash_lookup(const char *cp, size_t len, unsigned int hash)
 {
 	struct label *l;
-	size_t len = parser_strlen(parser);
 
-	for (l = labels; l != NULL; l = l->next) {
-		if (len == strlen(l->string) &&
-		    memcmp(parser->cp0, l->string, len) == 0) {
-			if (node != NULL && l->resolved) {
-				duplicate_label_error(parser, l);
-				node = NULL;
-			}
+	if (label_hash_size == 0) {
+		return NULL;
+	}
+	for (l = label_hash[hash & (label_hash_size - 1)]; l != NULL;
+	     l = l->hash_next) {
+		if (l->hash == hash && l->len == len &&
+		    memcmp(cp, l->string, len) == 0) {
 			break;
 		}
 	}
+	return l;
+}
+
+static struct label *
+gen_label(struct parser * const parser, struct prognode *node)
+{
+	struct label *l;
+	size_t len = parser_strlen(parser);
+	unsigned int hash = label_hash_string(parser->cp0, len);
+
+	l = label_hash_lookup(parser->cp0, len, hash);
+	if (l != NULL && node != NULL && l->resolved) {
+		duplicate_label_error(parser, l);
+		node = NULL;
+	}
 
 	if (l == NULL) {
 		l = calloc(1, sizeof(*l));
-		if (save_string(parser, &l->string) == 0) {
+		if ((l->len = save_string(parser, &l->string)) == 0) {
 			/* This should never happen. */
 			invalid_label_error(parser);
 		}
+		l->hash = hash;
 		l->next = labels;
 		labels = l;
+		label_hash_insert(l);
 	}
 
 	if (node != NULL) {
+		l->decl = node;
 		l->addr = node->addr;
 		l->resolved = node->lineno;
 		if (strcmp(l->string, SPECIAL_LABEL_COLLECTOR_NAME) == 0) {
@@ -544,7 +640,7 @@ gen_insn(struct parser * const parser)
 	} else {
 		if (node->opcode->flags & OPC_F_LABEL) {
 			assert(parser->label != NULL);
-			node->size += OPC_LBL_SIZE;
+			node->size += label_size;
 			node->label = parser->label;
 		}
 		if (node->opcode->flags & OPC_F_STRING) {
@@ -820,6 +916,785 @@ check_labels(void)
 	return rv;
 }
 
+/*
+ * The optimizer.  This performs the following transformations on
+ * the program:
+ *
+ *	- CALL immediately followed by RTN becomes JMP (tail call).
+ *
+ *	- Branches to a JMP are redirected to the JMP's destination,
+ *	  and a JMP to a RTN, ERR, etc. is replaced by that instruction.
+ *
+ *	- Instructions that cannot be reached from the program entry
+ *	  point or the special labels are removed.
+ *
+ *	- A block of code that is only reached by a JMP is moved to
+ *	  follow the JMP, and the JMP is removed.
+ *
+ * Addresses are re-computed afterwards.
+ */
+static bool Oflag;
+
+#define	OPT_MAX_THREAD	32		/* guard against JMP loops */
+
+static unsigned int opt_tailcalls;
+static unsigned int opt_threaded;
+static unsigned int opt_removed;
+static unsigned int opt_relaid;
+
+static const struct opcode *
+opcode_lookup(uint8_t val)
+{
+	const struct opcode *o;
+
+	for (o = opcode_tab; o->str != NULL; o++) {
+		if (o->val == val) {
+			return o;
+		}
+	}
+	abort();
+}
+
+static struct prognode *
+next_insn(struct prognode *node)
+{
+	while (node != NULL && node->opcode == NULL) {
+		node = node->next;
+	}
+	return node;
+}
+
+static struct prognode *
+label_target(const struct label *l)
+{
+	return next_insn(l->decl);
+}
+
+static inline bool
+terminal_p(const struct prognode *node)
+{
+	return (node->opcode->flags & OPC_F_TERM) != 0;
+}
+
+static inline bool
+special_label_p(const struct label *l)
+{
+	return l == special_label_collector || l == special_label_executor;
+}
+
+static void
+opt_tail_calls(void)
+{
+	const struct opcode *jmp = opcode_lookup(OPC_JMP);
+	struct prognode *node, *next;
+
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode == NULL || node->opcode->val != OPC_CALL) {
+			continue;
+		}
+		next = next_insn(node->next);
+		if (next != NULL && next->opcode->val == OPC_RTN) {
+			node->opcode = jmp;
+			opt_tailcalls++;
+		}
+	}
+}
+
+static void
+opt_thread_jumps(void)
+{
+	struct prognode *node, *target;
+	int hops;
+
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode == NULL ||
+		    (node->opcode->flags & OPC_F_LABEL) == 0) {
+			continue;
+		}
+		for (hops = 0; hops < OPT_MAX_THREAD; hops++) {
+			target = label_target(node->label);
+			if (target == NULL || target == node ||
+			    target->opcode->val != OPC_JMP ||
+			    target->label == node->label) {
+				break;
+			}
+			node->label = target->label;
+			opt_threaded++;
+		}
+
+		/* JMP to an operand-less terminator; just do it here. */
+		target = label_target(node->label);
+		if (node->opcode->val == OPC_JMP && target != NULL &&
+		    target->opcode->flags == OPC_F_TERM) {
+			node->opcode = target->opcode;
+			node->label = NULL;
+			current_pc -= node->size - target->size;
+			node->size = target->size;
+			opt_threaded++;
+		}
+	}
+}
+
+/*
+ * Instructions are marked as they are pushed onto the work list, so
+ * each one is visited once.
+ */
+static void
+opt_mark_reachable(struct prognode *node, struct prognode **work,
+    unsigned int *nworkp)
+{
+	if (node != NULL && ! node->reachable) {
+		node->reachable = true;
+		work[(*nworkp)++] = node;
+	}
+}
+
+static void
+opt_remove_unreachable(void)
+{
+	struct prognode *node, **nodep, **work;
+	unsigned int nwork = 0;
+
+	work = calloc(insn_count, sizeof(*work));
+
+	opt_mark_reachable(next_insn(program_head), work, &nwork);
+	opt_mark_reachable(label_target(special_label_collector),
+	    work, &nwork);
+	opt_mark_reachable(label_target(special_label_executor),
+	    work, &nwork);
+
+	while (nwork != 0) {
+		node = work[--nwork];
+		if (! terminal_p(node)) {
+			opt_mark_reachable(next_insn(node->next),
+			    work, &nwork);
+		}
+		if (node->opcode->flags & OPC_F_LABEL) {
+			opt_mark_reachable(label_target(node->label),
+			    work, &nwork);
+		}
+	}
+	free(work);
+
+	for (nodep = &program_head; (node = *nodep) != NULL;) {
+		if (node->opcode != NULL && ! node->reachable) {
+			*nodep = node->next;
+			current_pc -= node->size;
+			insn_count--;
+			opt_removed++;
+		} else {
+			nodep = &node->next;
+		}
+	}
+}
+
+static void
+opt_count_refs(void)
+{
+	struct prognode *node;
+	struct label *l;
+
+	for (l = labels; l != NULL; l = l->next) {
+		l->refs = special_label_p(l) ? 1 : 0;
+	}
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode != NULL &&
+		    (node->opcode->flags & OPC_F_LABEL) != 0) {
+			node->label->refs++;
+		}
+	}
+}
+
+/*
+ * If the JMP's destination starts a block that nothing else enters,
+ * move that block to follow the JMP, and remove the JMP.  A block
+ * begins after a terminal instruction and ends with one, so it can be
+ * moved anywhere without changing what falls into or out of it.
+ */
+static void
+opt_relayout_jmp(struct prognode *jmp)
+{
+	struct prognode *target, *node, *bstart, *bend, *before;
+	int refs;
+
+	if ((target = label_target(jmp->label)) == NULL) {
+		return;
+	}
+
+	/*
+	 * Only labels may come between the block start and the target,
+	 * and the block must start after a terminal instruction (and
+	 * not at the very beginning of the program).
+	 */
+	for (refs = 0, bstart = target; (node = bstart->prev) != NULL &&
+	     node->opcode == NULL; bstart = node) {
+		refs += node->label->refs;
+	}
+	if (node == NULL || ! terminal_p(node) || refs != 1) {
+		return;
+	}
+
+	/* Find the end of the block; it must not contain the JMP. */
+	for (bend = target; bend != NULL; bend = bend->next) {
+		if (bend == jmp ||
+		    (bend->opcode != NULL && terminal_p(bend))) {
+			break;
+		}
+	}
+	if (bend == NULL || bend == jmp) {
+		return;
+	}
+
+	/* Unlink the block... */
+	before = bstart->prev;
+	before->next = bend->next;
+	if (bend->next != NULL) {
+		bend->next->prev = before;
+	}
+
+	/* ...and put it where the JMP was. */
+	if ((bstart->prev = jmp->prev) != NULL) {
+		jmp->prev->next = bstart;
+	} else {
+		program_head = bstart;
+	}
+	if ((bend->next = jmp->next) != NULL) {
+		jmp->next->prev = bend;
+	}
+
+	jmp->label->refs--;
+	current_pc -= jmp->size;
+	insn_count--;
+	opt_relaid++;
+}
+
+/*
+ * A JMP that can't be removed never becomes removable by moving some
+ * other block: moves don't change what precedes any other block or
+ * where any other block ends, and reference counts only go down.  So
+ * each JMP only needs to be looked at once.
+ */
+static void
+opt_relayout(void)
+{
+	struct prognode *node, *prev, **jmps;
+	unsigned int i, njmps = 0;
+
+	opt_count_refs();
+
+	jmps = calloc(insn_count, sizeof(*jmps));
+	for (prev = NULL, node = program_head; node != NULL;
+	     prev = node, node = node->next) {
+		node->prev = prev;
+		if (node->opcode != NULL && node->opcode->val == OPC_JMP) {
+			jmps[njmps++] = node;
+		}
+	}
+	for (i = 0; i < njmps; i++) {
+		opt_relayout_jmp(jmps[i]);
+	}
+	free(jmps);
+}
+
+static void
+opt_assign_addrs(void)
+{
+	struct prognode *node;
+	int addr;
+
+	for (addr = 0, node = program_head; node != NULL; node = node->next) {
+		node->addr = addr;
+		if (node->opcode == NULL) {
+			node->label->addr = addr;
+		}
+		addr += node->size;
+	}
+	assert(addr == current_pc);
+}
+
+static void
+optimize(void)
+{
+	unsigned int old_pc = current_pc;
+
+	opt_tail_calls();
+	opt_thread_jumps();
+	opt_remove_unreachable();
+	opt_relayout();
+	opt_assign_addrs();
+
+	printf("optimized: %u tail call%s, %u jump%s threaded, "
+	    "%u unreachable instruction%s removed, %u block%s moved\n",
+	    opt_tailcalls, plural(opt_tailcalls),
+	    opt_threaded, plural(opt_threaded),
+	    opt_removed, plural(opt_removed),
+	    opt_relaid, plural(opt_relaid));
+	printf("optimized: %u -> %u bytes\n", old_pc, current_pc);
+}
+
+/*
+ * The stack checker (-s).  This computes the effect each instruction
+ * has on the VM's expression stack and, using a summary of the net
+ * effect of each subroutine, a lower bound on the depth of the
+ * expression stack at every instruction.  A pop is proven safe if
+ * the lower bound covers it.  It also checks that a RTN can only be
+ * reached from inside a subroutine, i.e. that the control stack can't
+ * underflow.
+ *
+ * The VM still checks both stacks at run time; this is to catch
+ * mistakes in the VM program before they show up as VM aborts.
+ * Each subroutine is analyzed separately, so the cost grows with
+ * the number of subroutines times the size of the program.
+ */
+static bool sflag;
+
+#define	STK_F_COND	0x01	/* pushes only if it doesn't branch */
+#define	STK_F_VAR	0x02	/* pops a variable number; checks itself */
+#define	STK_F_RESET	0x04	/* empties the stack */
+
+struct stk_effect {
+	int8_t		pop;		/* most values popped */
+	int8_t		push;
+	uint8_t		flags;
+};
+
+#define	STK(x, pop, push, f)	[OPC_ ## x] = { pop, push, f }
+
+static const struct stk_effect stk_effects[OPC___COUNT] = {
+	STK(PRN,	1, 0, 0),
+	STK(XFER,	1, 0, 0),
+	STK(CMPR,	3, 0, 0),
+	STK(LIT,	0, 1, 0),
+	STK(INNUM,	0, 1, 0),
+	STK(ADD,	2, 1, 0),
+	STK(SUB,	2, 1, 0),
+	STK(NEG,	1, 1, 0),
+	STK(MUL,	2, 1, 0),
+	STK(DIV,	2, 1, 0),
+	STK(STORE,	2, 0, 0),
+	STK(TSTV,	0, 1, STK_F_COND),
+	STK(TSTN,	0, 1, STK_F_COND),
+	STK(IND,	1, 1, 0),
+	STK(INIT,	0, 0, STK_F_RESET),
+	STK(XINIT,	0, 0, STK_F_RESET),
+	STK(CMPRX,	3, 0, 0),
+	STK(FOR,	3, 0, 0),
+	STK(STEP,	1, 0, 0),
+	STK(NXTFOR,	1, 0, 0),
+	STK(MOD,	2, 1, 0),
+	STK(POW,	2, 1, 0),
+	STK(RND,	1, 1, 0),
+	STK(ABS,	1, 1, 0),
+	STK(TSTS,	0, 1, STK_F_COND),
+	STK(STR,	1, 1, 0),
+	STK(VAL,	1, 1, 0),
+	STK(HEX,	1, 1, 0),
+	STK(CPY,	1, 2, 0),
+	STK(LSTX,	2, 0, 0),
+	STK(STRLEN,	1, 1, 0),
+	STK(ASC,	1, 1, 0),
+	STK(CHR,	1, 1, 0),
+	STK(FIX,	1, 1, 0),
+	STK(SGN,	1, 1, 0),
+	STK(INVAR,	2, 1, 0),
+	STK(POP,	1, 0, 0),
+	STK(LDPRG,	1, 0, 0),
+	STK(SVPRG,	1, 0, 0),
+	STK(SRND,	1, 0, 0),
+	STK(FLR,	1, 1, 0),
+	STK(CEIL,	1, 1, 0),
+	STK(ATN,	1, 1, 0),
+	STK(COS,	1, 1, 0),
+	STK(SIN,	1, 1, 0),
+	STK(TAN,	1, 1, 0),
+	STK(EXP,	1, 1, 0),
+	STK(LOG,	1, 1, 0),
+	STK(SQR,	1, 1, 0),
+	STK(MKS,	2, 1, 0),
+	STK(SBSTR,	4, 1, 0),
+	STK(DSTORE,	1, 0, 0),
+	STK(DIM,	0, 0, STK_F_VAR),
+	STK(ARRY,	0, 1, STK_F_VAR),
+	STK(ADVCRS,	1, 1, 0),
+	STK(DEGRAD,	1, 1, 0),
+	STK(UPRLWR,	1, 1, 0),
+	STK(MEMO,	0, 0, 0),
+	STK(CEXPR,	0, 0, 0),
+	STK(DREAD,	1, 0, 0),
+	STK(DSEEK,	1, 0, 0),
+	STK(INSTR,	4, 1, 0),
+	STK(HGET,	2, 1, 0),
+	STK(HSET,	3, 0, 0),
+	STK(HDEL,	2, 0, 0),
+	STK(HINFO,	2, 1, 0),
+};
+
+#undef STK
+
+/*
+ * The state at an instruction is a lower bound on the depth relative
+ * to the subroutine's entry (rel), and a lower bound on the absolute
+ * depth (abs).  rel is STK_UNKNOWN after anything that can pop an
+ * unknown number of values.  A subroutine can't pop more than the
+ * VM's 64 entry expression stack holds, which keeps loops that pop
+ * from iterating forever.
+ */
+#define	STK_UNKNOWN	INT_MIN
+#define	STK_REL_MIN	(-64)
+
+struct stk_state {
+	int		rel;
+	int		abs;
+	bool		valid;
+};
+
+struct stk_routine {
+	struct prognode	*entry;
+	bool		toplevel;	/* not entered by CALL or DONE */
+	bool		hook;		/* ONDONE hook */
+	struct stk_state ret;		/* state at RTN */
+	int		entry_abs;	/* lower bound over all callers */
+	struct stk_state *state;	/* indexed by node->stk_idx */
+	struct prognode	**visited;	/* nodes with a valid state */
+	unsigned int	nvisited;
+};
+
+static struct stk_routine *stk_routines;
+static unsigned int stk_nroutines;
+static unsigned int stk_nnodes;
+static struct prognode **stk_work;
+static unsigned int stk_nwork;
+
+static unsigned int stk_pops;
+static unsigned int stk_proven;
+
+static inline int
+stk_max(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+static inline int
+stk_min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+static struct stk_routine *
+stk_add_routine(struct prognode *entry, bool toplevel)
+{
+	struct stk_routine *r;
+
+	if (entry == NULL) {
+		return NULL;
+	}
+	if (! toplevel && entry->stk_routine != NULL) {
+		return entry->stk_routine;
+	}
+	r = &stk_routines[stk_nroutines++];
+	r->entry = entry;
+	r->toplevel = toplevel;
+	r->entry_abs = toplevel ? 0 : INT_MAX;
+	r->state = calloc(stk_nnodes, sizeof(*r->state));
+	r->visited = calloc(stk_nnodes, sizeof(*r->visited));
+	if (! toplevel) {
+		entry->stk_routine = r;
+	}
+	return r;
+}
+
+/* Merge a new state into an existing one; true if it changed. */
+static bool
+stk_merge(struct stk_state *st, const struct stk_state *in)
+{
+	struct stk_state new;
+
+	if (! st->valid) {
+		*st = *in;
+		return true;
+	}
+	new.valid = true;
+	new.rel = stk_min(st->rel, in->rel);
+	new.abs = stk_min(st->abs, in->abs);
+	if (new.rel != st->rel || new.abs != st->abs) {
+		*st = new;
+		return true;
+	}
+	return false;
+}
+
+static struct stk_state
+stk_apply(struct stk_state in, int pop, int push)
+{
+	struct stk_state out = { .valid = true };
+
+	if (in.rel == STK_UNKNOWN || in.rel - pop + push < STK_REL_MIN) {
+		out.rel = STK_UNKNOWN;
+	} else {
+		out.rel = in.rel - pop + push;
+	}
+	out.abs = stk_max(in.abs, pop) - pop + push;
+	return out;
+}
+
+/* State after a call to a subroutine with the given summary. */
+static struct stk_state
+stk_apply_call(struct stk_state in, const struct stk_routine *r)
+{
+	struct stk_state out = { .abs = r->ret.abs, .valid = true };
+
+	if (r->ret.rel == STK_UNKNOWN) {
+		out.rel = STK_UNKNOWN;
+		return out;
+	}
+	if (in.rel == STK_UNKNOWN || in.rel + r->ret.rel < STK_REL_MIN) {
+		out.rel = STK_UNKNOWN;
+	} else {
+		out.rel = in.rel + r->ret.rel;
+	}
+	out.abs = stk_max(out.abs, in.abs + r->ret.rel);
+	return out;
+}
+
+static void
+stk_flow(struct stk_routine *r, struct prognode *node,
+    const struct stk_state *in)
+{
+	struct stk_state *st;
+
+	if (node == NULL) {
+		return;
+	}
+	st = &r->state[node->stk_idx];
+	if (! st->valid) {
+		r->visited[r->nvisited++] = node;
+	}
+	if (stk_merge(st, in)) {
+		stk_work[stk_nwork++] = node;
+	}
+}
+
+/*
+ * Analyze one subroutine with the current summaries of the others.
+ * Returns true if its own summary changed.
+ */
+static bool
+stk_analyze(struct stk_routine *r)
+{
+	const struct stk_effect *e;
+	struct stk_state in, out, br, ret = r->ret;
+	struct stk_routine *callee;
+	struct prognode *node;
+	unsigned int i;
+
+	for (i = 0; i < r->nvisited; i++) {
+		r->state[r->visited[i]->stk_idx].valid = false;
+	}
+	r->nvisited = 0;
+
+	in = (struct stk_state){ .rel = 0, .abs = 0, .valid = true };
+	stk_flow(r, r->entry, &in);
+
+	while (stk_nwork != 0) {
+		node = stk_work[--stk_nwork];
+		in = r->state[node->stk_idx];
+		e = &stk_effects[node->opcode->val];
+
+		switch (node->opcode->val) {
+		case OPC_CALL:
+			callee = label_target(node->label)->stk_routine;
+			if (callee->ret.valid) {
+				out = stk_apply_call(in, callee);
+				stk_flow(r, next_insn(node->next), &out);
+			}
+			continue;
+
+		case OPC_DONE:
+		case OPC_DONEM:
+			/* Any ONDONE hook may run before we continue. */
+			out = in;
+			for (i = 0; i < stk_nroutines; i++) {
+				if (stk_routines[i].hook &&
+				    stk_routines[i].ret.valid) {
+					br = stk_apply_call(in,
+					    &stk_routines[i]);
+					(void) stk_merge(&out, &br);
+				}
+			}
+			stk_flow(r, next_insn(node->next), &out);
+			continue;
+
+		case OPC_RTN:
+			(void) stk_merge(&ret, &in);
+			continue;
+
+		case OPC_ONDONE:
+			/* The label is a hook, not a branch. */
+			stk_flow(r, next_insn(node->next), &in);
+			continue;
+		}
+
+		if (e->flags & STK_F_RESET) {
+			out = (struct stk_state){ .rel = STK_UNKNOWN,
+						  .valid = true };
+		} else if (e->flags & STK_F_VAR) {
+			out = (struct stk_state){ .rel = STK_UNKNOWN,
+						  .abs = e->push,
+						  .valid = true };
+		} else {
+			out = stk_apply(in, e->pop, e->push);
+		}
+		if (node->opcode->flags & OPC_F_LABEL) {
+			br = (e->flags & STK_F_COND) ? stk_apply(in, e->pop, 0)
+						     : out;
+			stk_flow(r, label_target(node->label), &br);
+		}
+		if (! terminal_p(node)) {
+			stk_flow(r, next_insn(node->next), &out);
+		}
+	}
+
+	if (ret.valid != r->ret.valid || ret.rel != r->ret.rel ||
+	    ret.abs != r->ret.abs) {
+		r->ret = ret;
+		return true;
+	}
+	return false;
+}
+
+/* Lower bound on the absolute depth at a node in a subroutine. */
+static int
+stk_depth(const struct stk_routine *r, const struct stk_state *st)
+{
+	if (st->rel == STK_UNKNOWN) {
+		return st->abs;
+	}
+	return stk_max(st->abs, r->entry_abs + st->rel);
+}
+
+static bool
+check_stacks(void)
+{
+	struct prognode *node;
+	struct stk_routine *r, *callee;
+	struct stk_state *st;
+	unsigned int i, j, nentries = 3;
+	bool changed, rv = true;
+	int depth;
+
+	for (node = program_head; node != NULL; node = node->next) {
+		node->stk_idx = stk_nnodes++;
+		if (node->opcode != NULL &&
+		    (node->opcode->val == OPC_CALL ||
+		     node->opcode->val == OPC_ONDONE)) {
+			nentries++;
+		}
+	}
+	stk_routines = calloc(nentries, sizeof(*stk_routines));
+	stk_work = calloc(stk_nnodes, sizeof(*stk_work));
+
+	(void) stk_add_routine(next_insn(program_head), true);
+	(void) stk_add_routine(label_target(special_label_collector), true);
+	(void) stk_add_routine(label_target(special_label_executor), true);
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode == NULL) {
+			continue;
+		}
+		if (node->opcode->val == OPC_CALL) {
+			(void) stk_add_routine(label_target(node->label),
+			    false);
+		} else if (node->opcode->val == OPC_ONDONE) {
+			r = stk_add_routine(label_target(node->label), false);
+			r->hook = true;
+			r->entry_abs = 0;
+		}
+	}
+
+	/* Compute the subroutine summaries. */
+	do {
+		changed = false;
+		for (i = 0; i < stk_nroutines; i++) {
+			changed |= stk_analyze(&stk_routines[i]);
+		}
+	} while (changed);
+
+	/* Propagate absolute depths from callers to callees. */
+	do {
+		changed = false;
+		for (i = 0; i < stk_nroutines; i++) {
+			r = &stk_routines[i];
+			if (r->entry_abs == INT_MAX) {
+				continue;	/* never called */
+			}
+			for (j = 0; j < r->nvisited; j++) {
+				node = r->visited[j];
+				if (node->opcode->val != OPC_CALL) {
+					continue;
+				}
+				callee = label_target(node->label)->stk_routine;
+				depth = stk_depth(r, &r->state[node->stk_idx]);
+				if (depth < callee->entry_abs) {
+					callee->entry_abs = depth;
+					changed = true;
+				}
+			}
+		}
+	} while (changed);
+
+	for (i = 0; i < stk_nroutines; i++) {
+		r = &stk_routines[i];
+		if (r->entry_abs == INT_MAX) {
+			continue;
+		}
+		for (j = 0; j < r->nvisited; j++) {
+			node = r->visited[j];
+			st = &r->state[node->stk_idx];
+			node->stk_reached = true;
+			if (node->opcode->val == OPC_RTN && r->toplevel) {
+				node->stk_unproven = true;
+			}
+			if (stk_depth(r, st) <
+			    stk_effects[node->opcode->val].pop) {
+				node->stk_unproven = true;
+			}
+		}
+	}
+
+	for (node = program_head; node != NULL; node = node->next) {
+		if (! node->stk_reached) {
+			continue;
+		}
+		if (node->opcode->val == OPC_RTN && node->stk_unproven) {
+			fprintf(stderr, "*** RTN at line %d is reachable "
+			    "outside of a subroutine\n", node->lineno);
+			rv = false;
+			continue;
+		}
+		if (stk_effects[node->opcode->val].pop == 0) {
+			continue;
+		}
+		stk_pops++;
+		if (node->stk_unproven) {
+			dbg_printf("%s: %s at line %d may underflow\n",
+			    __func__, node->opcode->str, node->lineno);
+		} else {
+			stk_proven++;
+		}
+	}
+
+	printf("stack check: %u of %u expression stack pop%s proven safe\n",
+	    stk_proven, stk_pops, plural(stk_pops));
+
+	for (i = 0; i < stk_nroutines; i++) {
+		free(stk_routines[i].state);
+		free(stk_routines[i].visited);
+	}
+	free(stk_routines);
+	free(stk_work);
+
+	return rv;
+}
+
 static char *
 encode_number(char *cp, int num)
 {
@@ -832,6 +1707,10 @@ encode_addr(char *cp, int addr)
 {
 	*cp++ = (addr     ) & 0xff;
 	*cp++ = (addr >> 8) & 0xff;
+	if (label_size == OPC_LBL_SIZE_WIDE) {
+		*cp++ = (addr >> 16) & 0xff;
+		*cp++ = (addr >> 24) & 0xff;
+	}
 	return cp;
 }
 
@@ -845,7 +1724,16 @@ generate_program(void)
 	if (current_pc == 0) {
 		return NULL;
 	}
-	program = malloc(current_pc + (OPC_LBL_SIZE * 2));
+
+	/* Every address, including the special labels, must fit. */
+	if (label_size == OPC_LBL_SIZE && current_pc > 0xffff) {
+		fprintf(stderr, "*** program too large for %u-byte labels "
+		    "(%u bytes); use -L %u\n", label_size, current_pc,
+		    OPC_LBL_SIZE_WIDE);
+		return NULL;
+	}
+
+	program = malloc(OPC_HDR_SIZE + current_pc + (label_size * 2));
 
 	for (cp = program, node = program_head; debug && node != NULL;
 	     node = node->next) {
@@ -866,8 +1754,17 @@ generate_program(void)
 		printf("\n");
 	}
 
-	for (cp = program, node = program_head; node != NULL;
-	     node = node->next) {
+	cp = program;
+	*cp++ = OPC_HDR_MAGIC0;
+	*cp++ = OPC_HDR_MAGIC1;
+	*cp++ = OPC_HDR_MAGIC2;
+	*cp++ = OPC_HDR_MAGIC3;
+	*cp++ = OPC_HDR_VERSION;
+	*cp++ = label_size;
+	*cp++ = 0;
+	*cp++ = 0;
+
+	for (node = program_head; node != NULL; node = node->next) {
 		if (node->opcode == NULL) {
 			continue;
 		}
@@ -892,7 +1789,7 @@ generate_program(void)
 	cp = encode_addr(cp, special_label_collector->addr);
 	assert(special_label_executor != NULL);
 	cp = encode_addr(cp, special_label_executor->addr);
-	current_pc += (OPC_LBL_SIZE * 2);
+	current_pc += OPC_HDR_SIZE + (label_size * 2);
 
 	printf("program size: %u byte%s\n", current_pc, plural(current_pc));
 
@@ -904,10 +1801,12 @@ static char *myprogname;
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-o output.bin] input.asm\n",
+	fprintf(stderr, "usage: %s [-Os] [-L 2|4] [-o output.bin] input.asm\n",
 	    myprogname);
-	fprintf(stderr, "usage: %s -H[output.h] input.asm\n",
+	fprintf(stderr, "usage: %s [-Os] [-L 2|4] -H[output.h] input.asm\n",
 	    myprogname);
+	fprintf(stderr, "       (either form also accepts -m output.map, "
+	    "-j listing.json and -C output.c)\n");
 	exit(1);
 }
 
@@ -967,19 +1866,375 @@ output_binary(FILE *outfile, const char *output)
 	return true;
 }
 
+/*
+ * The address map reproduces every line of the input file, preceded
+ * by the address of the instruction on that line (or "-" if the line
+ * has no instruction) and a tab.  This allows tools to map VM program
+ * addresses back to the source.
+ */
+static bool
+output_map(FILE *outfile, const char *input, size_t insize)
+{
+	struct prognode *node;
+	const char *cp, *ep = input + insize;
+	int lineno, nlines, *addrs;
+
+	/* The optimizer may have re-ordered the nodes. */
+	for (nlines = 0, node = program_head; node != NULL;
+	     node = node->next) {
+		if (node->lineno > nlines) {
+			nlines = node->lineno;
+		}
+	}
+	addrs = malloc((nlines + 1) * sizeof(*addrs));
+	for (lineno = 0; lineno <= nlines; lineno++) {
+		addrs[lineno] = -1;
+	}
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode != NULL) {
+			addrs[node->lineno] = node->addr;
+		}
+	}
+
+	fprintf(outfile, "# %s: %u bytes\n", basename(infname), current_pc);
+
+	for (cp = input, lineno = 1; cp < ep; lineno++) {
+		if (lineno <= nlines && addrs[lineno] != -1) {
+			fprintf(outfile, "%d\t", addrs[lineno]);
+		} else {
+			fprintf(outfile, "-\t");
+		}
+		for (; cp < ep && *cp != '\n'; cp++) {
+			putc(*cp, outfile);
+		}
+		putc('\n', outfile);
+		cp++;
+	}
+	free(addrs);
+	return ferror(outfile) == 0;
+}
+
+/*
+ * Emit a machine-readable listing of the program as JSON:
+ *
+ *	program		source file, image size, header and label size
+ *	instructions	address, size, source line, opcode and operands
+ *	labels		address, source line and the addresses of the
+ *			instructions that reference the label
+ *	mix		static count of each opcode
+ *	keywords	for each TST of a keyword, how many TSTs are
+ *			executed to reach it along its chain of
+ *			failure branches
+ *
+ * Addresses are VM program counter values, i.e. relative to the
+ * end of the image header.
+ */
+static void
+json_string(FILE *outfile, const char *str)
+{
+	putc('"', outfile);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\') {
+			putc('\\', outfile);
+		}
+		putc(*str, outfile);
+	}
+	putc('"', outfile);
+}
+
+static void
+listing_tst_depths(void)
+{
+	struct prognode *node, *target;
+	int depth;
+
+	/* Find the TSTs that are reached by another's failure branch. */
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode != NULL && node->opcode->val == OPC_TST &&
+		    (target = label_target(node->label)) != NULL &&
+		    target->opcode->val == OPC_TST) {
+			target->tst_depth = -1;
+		}
+	}
+
+	/* Walk each chain from its head. */
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode == NULL || node->opcode->val != OPC_TST ||
+		    node->tst_depth != 0) {
+			continue;
+		}
+		for (depth = 1, target = node;
+		     target != NULL && target->opcode->val == OPC_TST &&
+		     target->tst_depth <= 0;
+		     target = label_target(target->label)) {
+			target->tst_depth = depth++;
+		}
+	}
+}
+
+static bool
+output_listing(FILE *outfile)
+{
+	struct prognode *node;
+	struct label *l;
+	unsigned int mix[OPC___COUNT] = { 0 };
+	const struct opcode *o;
+	const char *sep;
+	int i;
+
+	listing_tst_depths();
+
+	/* Gather the cross-references. */
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode != NULL &&
+		    (node->opcode->flags & OPC_F_LABEL) != 0) {
+			node->label->nxrefs++;
+		}
+	}
+	for (l = labels; l != NULL; l = l->next) {
+		l->xrefs = calloc(l->nxrefs + 1, sizeof(*l->xrefs));
+		l->nxrefs = 0;
+	}
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode != NULL &&
+		    (node->opcode->flags & OPC_F_LABEL) != 0) {
+			l = node->label;
+			l->xrefs[l->nxrefs++] = node;
+		}
+	}
+
+	fprintf(outfile, "{\n\"program\":{\"source\":");
+	json_string(outfile, basename(infname));
+	fprintf(outfile, ",\"size\":%u,\"header_size\":%d,"
+	    "\"label_size\":%u},\n", current_pc, OPC_HDR_SIZE, label_size);
+
+	fprintf(outfile, "\"instructions\":[");
+	for (sep = "\n", node = program_head; node != NULL;
+	     node = node->next) {
+		if (node->opcode == NULL) {
+			continue;
+		}
+		mix[node->opcode->val]++;
+		fprintf(outfile, "%s{\"addr\":%d,\"size\":%d,\"line\":%d,"
+		    "\"opcode\":\"%s\"", sep, node->addr, node->size,
+		    node->lineno, node->opcode->str);
+		if (node->opcode->flags & OPC_F_NUMBER) {
+			fprintf(outfile, ",\"number\":%d", node->number);
+		}
+		if (node->opcode->flags & OPC_F_LABEL) {
+			fprintf(outfile, ",\"label\":");
+			json_string(outfile, node->label->string);
+			fprintf(outfile, ",\"target\":%d", node->label->addr);
+		}
+		if (node->opcode->flags & OPC_F_STRING) {
+			fprintf(outfile, ",\"string\":");
+			json_string(outfile, node->string);
+		}
+		fprintf(outfile, "}");
+		sep = ",\n";
+	}
+	fprintf(outfile, "\n],\n");
+
+	fprintf(outfile, "\"labels\":[");
+	for (sep = "\n", node = program_head; node != NULL;
+	     node = node->next) {
+		if (node->opcode != NULL) {
+			continue;
+		}
+		l = node->label;
+		fprintf(outfile, "%s{\"name\":", sep);
+		json_string(outfile, l->string);
+		fprintf(outfile, ",\"addr\":%d,\"line\":%d", l->addr,
+		    l->resolved);
+		if (special_label_p(l)) {
+			fprintf(outfile, ",\"entry\":true");
+		}
+		fprintf(outfile, ",\"refs\":[");
+		for (i = 0; i < l->nxrefs; i++) {
+			fprintf(outfile, "%s%d", i ? "," : "",
+			    l->xrefs[i]->addr);
+		}
+		fprintf(outfile, "]}");
+		sep = ",\n";
+	}
+	fprintf(outfile, "\n],\n");
+
+	fprintf(outfile, "\"mix\":{");
+	for (sep = "\n", o = opcode_tab; o->str != NULL; o++) {
+		if (mix[o->val] != 0) {
+			fprintf(outfile, "%s\"%s\":%u", sep, o->str, mix[o->val]);
+			sep = ",\n";
+		}
+	}
+	fprintf(outfile, "\n},\n");
+
+	fprintf(outfile, "\"keywords\":[");
+	for (sep = "\n", node = program_head; node != NULL;
+	     node = node->next) {
+		if (node->opcode == NULL || node->opcode->val != OPC_TST ||
+		    node->tst_depth <= 0 || ! isalpha((unsigned char)
+						      node->string[0])) {
+			continue;
+		}
+		fprintf(outfile, "%s{\"keyword\":", sep);
+		json_string(outfile, node->string);
+		fprintf(outfile, ",\"addr\":%d,\"line\":%d,\"depth\":%d}",
+		    node->addr, node->lineno, node->tst_depth);
+		sep = ",\n";
+	}
+	fprintf(outfile, "\n]\n}\n");
+
+	for (l = labels; l != NULL; l = l->next) {
+		free(l->xrefs);
+		l->xrefs = NULL;
+		l->nxrefs = 0;
+	}
+
+	return ferror(outfile) == 0;
+}
+
+/*
+ * Emit the program as C source, to be included into tbvm.c.  Each
+ * instruction becomes a direct call to its implementation, preceded
+ * by the same per-instruction housekeeping that the interpreter loop
+ * performs (AOT_INSN()).  Branches to known destinations are native
+ * gotos; anything else (RTN, NXT, errors, etc.) goes back through a
+ * switch on the VM program counter.  The byte-coded program is still
+ * used for instruction operands.
+ */
+static void
+output_c_goto(FILE *outfile, const char *indent, const struct label *l)
+{
+	const struct prognode *target = label_target(l);
+
+	if (target != NULL) {
+		fprintf(outfile, "%sgoto L%d;\n", indent, target->addr);
+	} else {
+		fprintf(outfile, "%svm->pc = %d;\n%sgoto dispatch;\n",
+		    indent, l->addr, indent);
+	}
+}
+
+/*
+ * These may stop the VM (EXIT, or end-of-file on input) without
+ * changing the VM program counter.  The dispatcher checks for that.
+ */
+static bool
+output_c_may_stop(const struct prognode *node)
+{
+	switch (node->opcode->val) {
+	case OPC_EXIT:
+	case OPC_GETLINE:
+	case OPC_INNUM:
+	case OPC_INVAR:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool
+output_c(FILE *outfile)
+{
+	const struct prognode *node, *last = NULL;
+	int next;
+
+	fprintf(outfile,
+"/*\n"
+" * DO NOT EDIT.  THIS FILE WAS AUTOMATICALLY GENERATED FROM\n"
+" *     %s\n"
+" */\n"
+"\n"
+"static void\n"
+"tbvm_compiled_program(tbvm *vm)\n"
+"{\n"
+" dispatch:\n"
+"\tif (! vm->vm_run) {\n"
+"\t\treturn;\n"
+"\t}\n"
+"\tswitch (vm->pc) {\n", basename(infname));
+
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode != NULL) {
+			fprintf(outfile, "\tcase %d:\tgoto L%d;\n",
+			    node->addr, node->addr);
+		}
+	}
+	fprintf(outfile,
+"\tdefault:\n"
+"\t\tvm_abort(vm, \"!VM PROGRAM COUNTER OUT OF RANGE\");\n"
+"\t}\n");
+
+	for (node = program_head; node != NULL; node = node->next) {
+		if (node->opcode == NULL) {
+			fprintf(outfile, "\n\t/* %s: */\n", node->label->string);
+			continue;
+		}
+		last = node;
+		next = node->addr + node->size;
+		fprintf(outfile, " L%d:\tAOT_INSN(%d, OPC_%s);\n",
+		    node->addr, node->addr, node->opcode->str);
+
+		switch (node->opcode->val) {
+		case OPC_JMP:
+			output_c_goto(outfile, "\t", node->label);
+			break;
+
+		case OPC_CALL:
+			fprintf(outfile, "\tcstk_push(vm, %d);\n", next);
+			output_c_goto(outfile, "\t", node->label);
+			break;
+
+		case OPC_RTN:
+			fprintf(outfile, "\tvm->pc = cstk_pop(vm);\n"
+			    "\tgoto dispatch;\n");
+			break;
+
+		default:
+			fprintf(outfile, "\tOPC_%s_impl(vm);\n",
+			    node->opcode->str);
+			if (terminal_p(node) || output_c_may_stop(node)) {
+				fprintf(outfile, "\tgoto dispatch;\n");
+				break;
+			}
+			if (node->opcode->flags & OPC_F_LABEL) {
+				fprintf(outfile, "\tif (vm->pc == %d) {\n",
+				    node->label->addr);
+				output_c_goto(outfile, "\t\t", node->label);
+				fprintf(outfile, "\t}\n");
+			}
+			fprintf(outfile, "\tif (vm->pc != %d) {\n"
+			    "\t\tgoto dispatch;\n\t}\n", next);
+			break;
+		}
+	}
+	if (last != NULL && ! terminal_p(last)) {
+		fprintf(outfile, "\tgoto dispatch;\n");
+	}
+	fprintf(outfile, "}\n");
+
+	return ferror(outfile) == 0;
+}
+
 int
 main(int argc, char *argv[])
 {
 	char *input, *output;
-	char *outfname = NULL, *cp;
+	char *outfname = NULL, *mapfname = NULL, *cfname = NULL, *cp;
+	char *jsonfname = NULL;
 	off_t infsize;
 	bool oflag = false;
 	int ch;
 
 	myprogname = strdup(basename(argv[0]));
 
-	while ((ch = getopt(argc, argv, "dH::o:")) != -1) {
+	while ((ch = getopt(argc, argv, "C:dH::j:L:m:Oo:s")) != -1) {
 		switch (ch) {
+		case 'C':
+			cfname = strdup(optarg);
+			break;
+
 		case 'd':
 			debug = true;
 			break;
@@ -994,6 +2249,26 @@ main(int argc, char *argv[])
 			}
 			break;
 
+		case 'j':
+			jsonfname = strdup(optarg);
+			break;
+
+		case 'L':
+			label_size = (unsigned int)atoi(optarg);
+			if (label_size != OPC_LBL_SIZE &&
+			    label_size != OPC_LBL_SIZE_WIDE) {
+				usage();
+			}
+			break;
+
+		case 'm':
+			mapfname = strdup(optarg);
+			break;
+
+		case 'O':
+			Oflag = true;
+			break;
+
 		case 'o':
 			if (Hflag) {
 				usage();
@@ -1001,6 +2276,10 @@ main(int argc, char *argv[])
 			outfname = strdup(optarg);
 			break;
 
+		case 's':
+			sflag = true;
+			break;
+
 		default:
 			usage();
 		}
@@ -1041,12 +2320,15 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	input = malloc((size_t)infsize);
-	if (fread(input, (size_t)infsize, 1, infile) != 1) {
+	/* The parser relies on a NUL to find the end of the input. */
+	input = malloc((size_t)infsize + 1);
+	if (infsize != 0 &&
+	    fread(input, (size_t)infsize, 1, infile) != 1) {
 		fprintf(stderr, "unable to read input file '%s'\n",
 		    infname);
 		exit(1);
 	}
+	input[infsize] = '\0';
 	fclose(infile);
 
 	if (! parse(input)) {
@@ -1057,7 +2339,18 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (sflag && ! check_stacks()) {
+		exit(1);
+	}
+
+	if (Oflag) {
+		optimize();
+	}
+
 	output = generate_program();
+	if (output == NULL) {
+		exit(1);
+	}
 
 	FILE *outfile = fopen(outfname, "wb");
 	if (outfile == NULL) {
@@ -1081,5 +2374,53 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (mapfname != NULL) {
+		FILE *mapfile = fopen(mapfname, "w");
+		if (mapfile == NULL) {
+			fprintf(stderr, "unable to open map file '%s': %s\n",
+			    mapfname, strerror(errno));
+			exit(1);
+		}
+		success = output_map(mapfile, input, (size_t)infsize);
+		fclose(mapfile);
+		if (! success) {
+			fprintf(stderr, "unable to write map file '%s'\n",
+			    mapfname);
+			exit(1);
+		}
+	}
+
+	if (jsonfname != NULL) {
+		FILE *jsonfile = fopen(jsonfname, "w");
+		if (jsonfile == NULL) {
+			fprintf(stderr, "unable to open listing file '%s': %s\n",
+			    jsonfname, strerror(errno));
+			exit(1);
+		}
+		success = output_listing(jsonfile);
+		fclose(jsonfile);
+		if (! success) {
+			fprintf(stderr, "unable to write listing file '%s'\n",
+			    jsonfname);
+			exit(1);
+		}
+	}
+
+	if (cfname != NULL) {
+		FILE *cfile = fopen(cfname, "w");
+		if (cfile == NULL) {
+			fprintf(stderr, "unable to open C file '%s': %s\n",
+			    cfname, strerror(errno));
+			exit(1);
+		}
+		success = output_c(cfile);
+		fclose(cfile);
+		if (! success) {
+			fprintf(stderr, "unable to write C file '%s'\n",
+			    cfname);
+			exit(1);
+		}
+	}
+
 	return 0;
 }
@@ -37,11 +37,11 @@
  */
 
 #include <assert.h>
-#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <setjmp.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -100,8 +100,16 @@ typedef struct string {
 	char *str;
 	size_t len;
 	int lineno;
+	struct string *parent;	/* != NULL for a slice of parent->str */
+	unsigned int hash;	/* 0 == not computed */
 } string;
 
+/*
+ * String literals in stored lines are interned, so that evaluating
+ * the same literal again yields the same (hashed) string object.
+ */
+#define	SIZE_STRING_INTERN	1024	/* power of 2 */
+
 struct value {
 	int type;
 	union {
@@ -115,6 +123,73 @@ struct value {
 #define	VALUE_TYPE_STRING	2	/* string field */
 #define	VALUE_TYPE_VARREF	10	/* var_ref field */
 
+/*
+ * TST chain cache entry.  XINIT and MEMO are each followed by a chain
+ * of TSTs for keywords (statements and function names, respectively).
+ * The outcome of such a chain depends only on the program text, so for
+ * each stored line and cursor position we remember where the VM program
+ * counter and line cursor ended up after the last TST in the chain, and
+ * go straight there the next time.  SCAN and ADVEOL use the same
+ * cache for their own outcomes.
+ */
+struct tst_cache {
+	int		lineno;		/* 0 == empty */
+	int		lbuf_ptr;	/* cursor at start of chain */
+	unsigned int	chain_pc;	/* VM PC of first TST in chain */
+	unsigned int	pc;		/* VM PC after the TSTs */
+	int		tst_lbuf_ptr;	/* cursor after the TSTs */
+};
+
+#define	SIZE_TST_CACHE	4096	/* power of 2 */
+
+/*
+ * Compiled expressions.  The path the IL takes through EXPR depends
+ * only on the program text, so the first time an expression in a
+ * stored line is evaluated, the VM records the instructions along that
+ * path that operate on the AESTK, with the operands parsed from the
+ * line (variables, numbers, and string literals) resolved.  Later
+ * evaluations run that sequence directly and skip the parse.
+ */
+struct expr_op {
+	int		kind;
+	unsigned int	addr;	/* VM PC (EXEC) or lbuf offset (STR) */
+	unsigned int	len;	/* string length (STR) */
+	struct value	value;	/* constant (PUSH) or variable (VAR) */
+};
+
+#define	EXPR_OP_EXEC	0	/* run the IL insn at addr */
+#define	EXPR_OP_PUSH	1	/* push value */
+#define	EXPR_OP_VAR	2	/* push the value of value.var_ref */
+#define	EXPR_OP_STR	3	/* push the string literal at addr */
+
+struct expr_cache {
+	int		lineno;		/* 0 == empty */
+	int		lbuf_ptr;	/* cursor at EXPR */
+	int		end_lbuf_ptr;	/* cursor after the expression */
+	unsigned int	nops;
+	struct expr_op	*ops;		/* NULL == can't be compiled */
+};
+
+#define	SIZE_EXPR_CACHE	1024	/* power of 2 */
+#define	SIZE_EXPR_OPS	128	/* longest expression that is compiled */
+
+/*
+ * DATA item index.  Rather than having READ walk the program looking
+ * for the next DATA statement, the position of every DATA item in the
+ * program is recorded the first time one is needed after the program
+ * is changed.  Items that are valid numbers are converted up front.
+ */
+struct data_item {
+	int		lineno;
+	int		lbuf_ptr;	/* cursor at item */
+	int		end_lbuf_ptr;	/* cursor after item; -1 == malformed */
+	int		str_ptr;	/* item text */
+	int		str_len;
+	bool		quoted;
+	bool		numeric;	/* number is valid */
+	tbvm_number	number;
+};
+
 struct array_dim {
 	int	nelem;		/* number of elements in this dimension */
 	int	idxsize;	/* total index size of this dimension */
@@ -133,12 +208,65 @@ array_size(int ndim)
 	return sizeof(struct array) + sizeof(struct array_dim) * ndim;
 }
 
+/*
+ * Associative arrays.  Like arrays, these live in their own namespace
+ * and are named by a variable, whose type is the type of the values.
+ * Keys are strings; entries live in an open-addressing hash table with
+ * linear probing.  Deleted entries leave a tombstone in their slot so
+ * that probe chains are not broken.
+ */
+struct dict_ent {
+	string		*key;		/* NULL == empty */
+	unsigned int	hash;
+	bool		deleted;	/* tombstone */
+	struct value	value;
+};
+
+struct dict {
+	unsigned int	size;		/* number of slots; power of 2 */
+	unsigned int	count;		/* live entries */
+	unsigned int	used;		/* live entries + tombstones */
+	unsigned int	iter_idx;	/* KEY$() cursor entry (0 == none) */
+	unsigned int	iter_slot;	/* ...and its slot */
+	struct dict_ent	*ents;
+};
+
+#define	DICT_MINSIZE	8
+
+/*
+ * Sampling profiler histogram entry.  Samples are keyed by the current
+ * BASIC line, the VM PC and opcode, and the chain of lines that issued
+ * the GOSUBs currently on the subroutine stack.
+ */
+#define	PROF_MAXDEPTH	16
+#define	PROF_NSAMPLES	4096		/* must be a power of 2 */
+
+struct prof_sample {
+	unsigned long	count;
+	int		lineno;
+	unsigned int	pc;
+	unsigned int	opc;
+	int		depth;
+	int		chain[PROF_MAXDEPTH];
+};
+
+/*
+ * Hardware performance counter totals for an opcode or a BASIC line.
+ */
+struct perf_stat {
+	unsigned long	count;
+	unsigned long long val[TBVM_PERF_NCOUNTERS];
+};
+
 struct tbvm {
 	jmp_buf		vm_abort_env;
 	jmp_buf		basic_error_env;
 
-	const char	*vm_prog;
+	char		*vm_prog;	/* private copy; see quicken() */
 	size_t		vm_progsize;
+	bool		vm_prog_builtin; /* copy of tbvm_program[] */
+	unsigned int	vm_lblsize;	/* size of a label operand */
+	char		vm_prog_error[64]; /* why tbvm_set_prog() failed */
 	bool		vm_run;
 	unsigned int	pc;	/* VM program counter */
 	unsigned int	opc_pc;	/* VM program counter of current opcode */
@@ -159,6 +287,7 @@ struct tbvm {
 	string		*strings;
 	unsigned int	strings_need_gc;
 	bool		static_strings_valid;
+	string		*interned[SIZE_STRING_INTERN];
 
 	void		*context;
 	const struct tbvm_file_io *file_io;
@@ -170,11 +299,13 @@ struct tbvm {
 
 	const struct tbvm_time_io *time_io;
 	const struct tbvm_exc_io *exc_io;
+	const struct tbvm_trace_io *trace_io;
 
 	unsigned int	rand_seed;
 
 	struct value	vars[NUM_VARS];
 	struct array	*array_vars[NUM_VARS];
+	struct dict	*dict_vars[NUM_VARS];
 
 	char		direct_lbuf[SIZE_LBUF];
 	char		tmp_buf[SIZE_LBUF];
@@ -182,10 +313,25 @@ struct tbvm {
 	char		*lbuf;
 	int		lbuf_ptr;
 
+	struct tst_cache tst_cache[SIZE_TST_CACHE];
+	struct tst_cache *tst_fill;	/* entry being filled in by TST */
+	unsigned int	tst_fill_pc;	/* VM PC of next TST in chain */
+
+	struct expr_cache expr_cache[SIZE_EXPR_CACHE];
+	struct expr_cache *expr_rec;	/* entry being recorded */
+	int		expr_rec_depth;	/* CSTK depth of the EXPR */
+	unsigned int	expr_rec_nops;
+	struct expr_op	expr_rec_ops[SIZE_EXPR_OPS];
+
 	int		saved_lineno;		/* != 0 when in DATA mode */
 	int		saved_lbuf_ptr;
 	int		data_lbuf_ptr;
 
+	bool		data_indexed;
+	struct data_item *data_items;
+	unsigned int	ndata_items;
+	unsigned int	data_item_next;	/* hint for data_item_next() */
+
 	int		ondone;
 	int		cstk[SIZE_CSTK];
 	int		cstk_ptr;
@@ -195,12 +341,35 @@ struct tbvm {
 
 	struct value	aestk[SIZE_AESTK];
 	int		aestk_ptr;
+
+	struct prof_sample *prof;
+	unsigned long	prof_dropped;
+
+	const struct tbvm_perf_io *perf_io;
+	unsigned int	perf_period;
+	unsigned int	perf_countdown;
+	unsigned long long perf_bias[TBVM_PERF_NCOUNTERS];
+	struct perf_stat *perf_opcs;	/* [OPC_Q___COUNT] */
+	struct perf_stat *perf_lines;	/* [MAX_LINENO + 1] */
+
+	unsigned long	*cov;		/* [vm_progsize] */
+
+	struct tbvm_limits limits;	/* 0 == no limit */
+	int		limit_status;	/* last limit that tripped */
+	unsigned long	limit_check_insns; /* vm_insns at next check */
+	unsigned long	limit_base_insns; /* vm_insns at start of command */
+	unsigned long	limit_base_time; /* wall time at start of command */
+	unsigned long	string_bytes;	/* live dynamic string bytes */
+	unsigned long	array_elems;	/* live array + dictionary elements */
 };
 
 /*********** Forward declarations **********/
 
 static void	prog_file_fini(tbvm *);
 static void	exit_data_mode(tbvm *);
+static void	limits_reset(tbvm *);
+static void	basic_limit_error(tbvm *, int) DOES_NOT_RETURN;
+static void	expr_run(tbvm *, const struct expr_cache *);
 
 /*********** Driver interface routines **********/
 
@@ -260,6 +429,12 @@ vm_io_gettime(tbvm *vm, unsigned long *timep)
 	return false;
 }
 
+static bool
+vm_io_perf_read(tbvm *vm, unsigned long long *vals)
+{
+	return (*vm->perf_io->io_perf_read)(vm->context, vals);
+}
+
 static int
 vm_io_math_exc(tbvm *vm)
 {
@@ -269,6 +444,64 @@ vm_io_math_exc(tbvm *vm)
 	return -1;
 }
 
+static void
+vm_trace_line(tbvm *vm, int lineno)
+{
+	if (vm->trace_io != NULL) {
+		(*vm->trace_io->io_trace_line)(vm->context, lineno);
+	}
+}
+
+static void
+vm_trace_direct(tbvm *vm)
+{
+	if (vm->trace_io != NULL) {
+		(*vm->trace_io->io_trace_direct)(vm->context);
+	}
+}
+
+static void
+vm_trace_gosub(tbvm *vm, int lineno)
+{
+	if (vm->trace_io != NULL) {
+		(*vm->trace_io->io_trace_gosub)(vm->context, lineno);
+	}
+}
+
+static void
+vm_trace_return(tbvm *vm)
+{
+	if (vm->trace_io != NULL) {
+		(*vm->trace_io->io_trace_return)(vm->context);
+	}
+}
+
+static void
+vm_trace_gc(tbvm *vm, unsigned int nfreed)
+{
+	if (vm->trace_io != NULL) {
+		(*vm->trace_io->io_trace_gc)(vm->context, nfreed);
+	}
+}
+
+static void
+vm_trace_array(tbvm *vm, int vidx, int nelem)
+{
+	char name[3];
+
+	if (vm->trace_io != NULL) {
+		if (vidx >= SVAR_BASE) {
+			name[0] = 'A' + (vidx - SVAR_BASE);
+			name[1] = '$';
+			name[2] = '\0';
+		} else {
+			name[0] = 'A' + vidx;
+			name[1] = '\0';
+		}
+		(*vm->trace_io->io_trace_array)(vm->context, name, nelem);
+	}
+}
+
 /*********** String routines **********/
 
 static char empty_string_str[1] = { 0 };
@@ -277,12 +510,82 @@ static struct string empty_string = {
 	.len = 0,
 };
 
+/*
+ * One-character strings.  Like the empty string, these are shared by
+ * every VM and are never counted or freed.  They are initialized
+ * statically, and never written, so VMs on different threads can
+ * share them safely.
+ */
+#define	REP4(m, c)	m(c), m((c) + 1), m((c) + 2), m((c) + 3)
+#define	REP16(m, c)	REP4(m, c), REP4(m, (c) + 4),			\
+			REP4(m, (c) + 8), REP4(m, (c) + 12)
+#define	REP64(m, c)	REP16(m, c), REP16(m, (c) + 16),		\
+			REP16(m, (c) + 32), REP16(m, (c) + 48)
+#define	REP256(m)	REP64(m, 0), REP64(m, 64),			\
+			REP64(m, 128), REP64(m, 192)
+
+#define	CHAR_STRING_STR(c)	{ (char)(c), '\0' }
+#define	CHAR_STRING(c)		{ .str = char_strings_str[(c)], .len = 1 }
+
+static char char_strings_str[UCHAR_MAX + 1][2] = {
+	REP256(CHAR_STRING_STR)
+};
+static struct string char_strings[UCHAR_MAX + 1] = {
+	REP256(CHAR_STRING)
+};
+
+#undef CHAR_STRING
+#undef CHAR_STRING_STR
+#undef REP256
+#undef REP64
+#undef REP16
+#undef REP4
+
+static string *
+string_char(unsigned char c)
+{
+	return &char_strings[c];
+}
+
+static bool
+string_immortal_p(const string *string)
+{
+	return string == &empty_string ||
+	    (string >= &char_strings[0] &&
+	     string <= &char_strings[UCHAR_MAX]);
+}
+
+static string *string_retain(tbvm *, string *);
+static void	string_release(tbvm *, string *);
+
+static string *
+string_link(tbvm *vm, string *string)
+{
+	string->refs = 0;
+
+	string->next = vm->strings;
+	vm->strings = string;
+	vm->strings_need_gc++;
+	assert(vm->strings_need_gc != 0);
+
+	return string;
+}
+
 static string *
 string_alloc(tbvm *vm, char *str, size_t len, int lineno)
 {
 	if (len == 0) {
 		return &empty_string;
 	}
+	if (len == 1 && str != NULL) {
+		return string_char((unsigned char)*str);
+	}
+
+	if (lineno == 0 && vm->limits.max_string_bytes != 0 &&
+	    (vm->string_bytes > vm->limits.max_string_bytes ||
+	     len > vm->limits.max_string_bytes - vm->string_bytes)) {
+		basic_limit_error(vm, TBVM_LIMIT_STRING_BYTES);
+	}
 
 	string *string = malloc(sizeof(*string));
 	if (lineno) {
@@ -297,22 +600,86 @@ string_alloc(tbvm *vm, char *str, size_t len, int lineno)
 		if (str != NULL) {
 			memcpy(string->str, str, len);
 		}
+		vm->string_bytes += len;
 	}
 	string->len = len;
 	string->lineno = lineno;
-	string->refs = 0;
+	string->parent = NULL;
+	string->hash = 0;
 
-	string->next = vm->strings;
-	vm->strings = string;
-	vm->strings_need_gc++;
-	assert(vm->strings_need_gc != 0);
+	return string_link(vm, string);
+}
 
-	return string;
+/*
+ * Return a substring of str1.  Substrings of static strings reference
+ * the program text, as usual.  Substrings of dynamic strings are slices
+ * that reference the buffer of the (outermost) parent string, which
+ * they keep alive.
+ */
+static string *
+string_slice(tbvm *vm, string *str1, size_t pos, size_t len)
+{
+	if (len == 0) {
+		return &empty_string;
+	}
+	if (len == 1) {
+		return string_char((unsigned char)str1->str[pos]);
+	}
+
+	if (str1->lineno) {
+		return string_alloc(vm, &str1->str[pos], len, str1->lineno);
+	}
+
+	if (str1->parent != NULL) {
+		pos += str1->str - str1->parent->str;
+		str1 = str1->parent;
+	}
+
+	string *string = malloc(sizeof(*string));
+	string->str = &str1->str[pos];
+	string->len = len;
+	string->lineno = 0;
+	string->parent = string_retain(vm, str1);
+	string->hash = 0;
+
+	return string_link(vm, string);
+}
+
+/*
+ * Give a slice its own copy of its text if it's all that is keeping
+ * a much larger parent string alive.
+ */
+static void
+string_unslice(tbvm *vm, string *string)
+{
+	struct string *parent = string->parent;
+	char *str;
+
+	if (parent->refs != 1 || parent->len < string->len * 2) {
+		return;
+	}
+
+	str = malloc(string->len + 1);
+	memcpy(str, string->str, string->len);
+	str[string->len] = '\0';
+	string->str = str;
+	string->parent = NULL;
+	vm->string_bytes += string->len;
+
+	string_release(vm, parent);
 }
 
 static string *
 string_concatenate(tbvm *vm, string *str1, string *str2)
 {
+	/* Strings are immutable, so there's no need to copy these. */
+	if (str2->len == 0) {
+		return str1;
+	}
+	if (str1->len == 0) {
+		return str2;
+	}
+
 	string *string = string_alloc(vm, NULL, str1->len + str2->len, 0);
 	memcpy(string->str, str1->str, str1->len);
 	memcpy(&string->str[str1->len], str2->str, str2->len);
@@ -325,9 +692,11 @@ string_terminate(tbvm *vm, string *str1)
 {
 	/*
 	 * Dynamic strings are NUL-terminated already, but static strings
-	 * are not.
+	 * are not, and slices are only if they run to the end of their
+	 * parent.
 	 */
-	if (str1->lineno == 0) {
+	if (str1->lineno == 0 &&
+	    (str1->parent == NULL || str1->str[str1->len] == '\0')) {
 		return str1;
 	}
 	return string_alloc(vm, str1->str, str1->len, 0);
@@ -339,6 +708,10 @@ string_compare(string *str1, string *str2)
 	int len = str1->len < str2->len ? str1->len : str2->len;
 	int rv;
 
+	if (str1 == str2) {
+		return 0;
+	}
+
 	rv = memcmp(str1->str, str2->str, len);
 	if (rv == 0) {
 		if (str1->len < str2->len) {
@@ -350,6 +723,140 @@ string_compare(string *str1, string *str2)
 	return rv;
 }
 
+/*
+ * Equality test that avoids looking at the text when it can.  One-
+ * character strings are shared, and so are equal only if they are the
+ * same object.
+ */
+static bool
+string_equal_p(string *str1, string *str2)
+{
+	if (str1 == str2) {
+		return true;
+	}
+	if (str1->len != str2->len) {
+		return false;
+	}
+	if (str1->len == 1 && string_immortal_p(str1) &&
+	    string_immortal_p(str2)) {
+		return false;
+	}
+	if (str1->hash != 0 && str2->hash != 0 && str1->hash != str2->hash) {
+		return false;
+	}
+	return memcmp(str1->str, str2->str, str1->len) == 0;
+}
+
+/*
+ * Copy len bytes from src to dst, converting letters to upper-case or
+ * lower-case.  This is what toupper() and tolower() do in the "C"
+ * locale, but without a library call per character, so the compiler
+ * can vectorize it.
+ */
+static void
+string_copy_case(char *dst, const char *src, size_t len, bool upper)
+{
+	unsigned char first = upper ? 'a' : 'A';
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)src[i];
+
+		dst[i] = (char)((unsigned char)(c - first) < 26 ? c ^ 0x20 : c);
+	}
+}
+
+/*
+ * Return the offset of the first occurrence of needle in haystack at or
+ * after start, or -1 if there is none.  memchr() finds the candidates
+ * for the first character, and the last character is checked before
+ * comparing the rest.  This works on static strings in place.
+ */
+static int
+string_search(const string *haystack, const string *needle, size_t start)
+{
+	const char *cp, *last;
+
+	if (start >= haystack->len) {
+		return -1;
+	}
+	if (needle->len == 0) {
+		return (int)start;
+	}
+	if (needle->len > haystack->len - start) {
+		return -1;
+	}
+
+	/* last is the last place a match could start. */
+	cp = &haystack->str[start];
+	last = &haystack->str[haystack->len - needle->len];
+	while ((cp = memchr(cp, needle->str[0], last - cp + 1)) != NULL) {
+		if (cp[needle->len - 1] == needle->str[needle->len - 1] &&
+		    memcmp(cp, needle->str, needle->len) == 0) {
+			return (int)(cp - haystack->str);
+		}
+		if (cp++ == last) {
+			break;
+		}
+	}
+	return -1;
+}
+
+static unsigned int
+string_hash(const char *str, size_t len)
+{
+	unsigned int hash = 2166136261u;	/* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+	}
+	return hash != 0 ? hash : 1;
+}
+
+/*
+ * Return the string for the literal at str in the current line.
+ */
+static string *
+string_intern(tbvm *vm, char *str, size_t len)
+{
+	string **slotp, *string;
+
+	if (vm->direct || len <= 1) {
+		return string_alloc(vm, str, len, vm->lineno);
+	}
+
+	slotp = &vm->interned[(vm->lineno * 31 + (str - vm->lbuf)) &
+	    (SIZE_STRING_INTERN - 1)];
+	string = *slotp;
+	if (string != NULL && string->str == str && string->len == len &&
+	    string->lineno == vm->lineno) {
+		return string;
+	}
+
+	if (string != NULL) {
+		string_release(vm, string);
+	}
+	string = string_alloc(vm, str, len, vm->lineno);
+	string->hash = string_hash(str, len);
+	*slotp = string_retain(vm, string);
+
+	return string;
+}
+
+static void
+string_intern_flush(tbvm *vm)
+{
+	int i;
+
+	for (i = 0; i < SIZE_STRING_INTERN; i++) {
+		if (vm->interned[i] != NULL) {
+			string_release(vm, vm->interned[i]);
+			vm->interned[i] = NULL;
+		}
+	}
+}
+
 static void
 string_invalidate_all_static(tbvm *vm)
 {
@@ -360,6 +867,8 @@ string_invalidate_all_static(tbvm *vm)
 		     string = string->next) {
 			if (string->lineno) {
 				string->str = empty_string_str;
+				string->len = 0;
+				string->hash = 0;
 			}
 		}
 		vm->static_strings_valid = false;
@@ -369,9 +878,12 @@ string_invalidate_all_static(tbvm *vm)
 static void
 string_free(tbvm *vm, string *string)
 {
-	if (string != &empty_string) {
-		if (string->lineno == 0) {
+	if (! string_immortal_p(string)) {
+		if (string->parent != NULL) {
+			string_release(vm, string->parent);
+		} else if (string->lineno == 0) {
 			free(string->str);
+			vm->string_bytes -= string->len;
 		}
 		free(string);
 	}
@@ -380,7 +892,7 @@ string_free(tbvm *vm, string *string)
 static string *
 string_retain(tbvm *vm, string *string)
 {
-	if (string != &empty_string) {
+	if (! string_immortal_p(string)) {
 		if (string->refs == 0) {
 			assert(vm->strings_need_gc != 0);
 			vm->strings_need_gc--;
@@ -394,7 +906,7 @@ string_retain(tbvm *vm, string *string)
 static void
 string_release(tbvm *vm, string *string)
 {
-	if (string != &empty_string) {
+	if (! string_immortal_p(string)) {
 		assert(string->refs != 0);
 		string->refs--;
 		if (string->refs == 0) {
@@ -409,6 +921,7 @@ string_gc(tbvm *vm)
 {
 	if (vm->strings_need_gc) {
 		string *string, *next, **nextp;
+		unsigned int nfreed = 0;
 
 		for (string = vm->strings, nextp = &vm->strings;
 		     string != NULL;
@@ -417,11 +930,23 @@ string_gc(tbvm *vm)
 			if (string->refs == 0) {
 				*nextp = next;
 				string_free(vm, string);
+				nfreed++;
 			} else {
+				/*
+				 * A slice is always newer than its parent,
+				 * so if this drops the last reference to the
+				 * parent, it's freed further down the list.
+				 */
+				if (string->parent != NULL) {
+					string_unslice(vm, string);
+				}
 				nextp = &string->next;
 			}
 		}
 		vm->strings_need_gc = 0;
+		if (nfreed != 0) {
+			vm_trace_gc(vm, nfreed);
+		}
 	}
 }
 
@@ -735,6 +1260,22 @@ basic_out_of_memory_error(tbvm *vm)
 	basic_error(vm, "OUT OF MEMORY");
 }
 
+static void DOES_NOT_RETURN
+basic_limit_error(tbvm *vm, int which)
+{
+	static const char * const limit_errors[] = {
+		[TBVM_LIMIT_INSNS]		= "INSTRUCTION LIMIT",
+		[TBVM_LIMIT_STRING_BYTES]	= "STRING SPACE LIMIT",
+		[TBVM_LIMIT_ARRAY_ELEMS]	= "ARRAY SPACE LIMIT",
+		[TBVM_LIMIT_SECONDS]		= "TIME LIMIT",
+	};
+
+	/* Don't check again until the next command. */
+	vm->limit_check_insns = ULONG_MAX;
+	vm->limit_status = which;
+	basic_error(vm, limit_errors[which]);
+}
+
 /*********** Abstract number math routines **********/
 
 #ifdef TBVM_CONFIG_INTEGER_ONLY
@@ -1077,6 +1618,25 @@ sbrstk_push(tbvm *vm, const struct subr *subrp)
 		}
 	}
 	vm->sbrstk[slot] = *subrp;
+
+	if (subrp->var == SUBR_VAR_SUBROUTINE) {
+		vm_trace_gosub(vm, subrp->lineno);
+	}
+}
+
+/*
+ * Discard subroutine stack entries down to the specified depth,
+ * letting the tracer know about any GOSUBs that are unwound.
+ */
+static void
+sbrstk_unwind(tbvm *vm, int ptr)
+{
+	while (vm->sbrstk_ptr > ptr) {
+		vm->sbrstk_ptr--;
+		if (vm->sbrstk[vm->sbrstk_ptr].var == SUBR_VAR_SUBROUTINE) {
+			vm_trace_return(vm);
+		}
+	}
 }
 
 static struct subr *
@@ -1098,7 +1658,7 @@ sbrstk_pop(tbvm *vm, var_ref var, struct subr *subrp, bool pop_match)
 		     vm->sbrstk[slot].var != SUBR_VAR_SUBROUTINE) ||
 		    (var != SUBR_VAR_ANYVAR && vm->sbrstk[slot].var == var)) {
 			*subrp = vm->sbrstk[slot];
-			vm->sbrstk_ptr = pop_match ? slot : slot + 1;
+			sbrstk_unwind(vm, pop_match ? slot : slot + 1);
 			return true;
 		}
 	}
@@ -1241,11 +1801,32 @@ var_release_array(tbvm *vm, int vidx)
 		for (i = 0; i < array->totelem; i++) {
 			value_release(vm, &array->elem[i]);
 		}
+		vm->array_elems -= array->totelem;
 		free(array->elem);
 		free(array);
 	}
 }
 
+static void
+var_release_dict(tbvm *vm, int vidx)
+{
+	struct dict *dict;
+	unsigned int i;
+
+	if ((dict = vm->dict_vars[vidx]) != NULL) {
+		vm->dict_vars[vidx] = NULL;
+		for (i = 0; i < dict->size; i++) {
+			if (dict->ents[i].key != NULL) {
+				string_release(vm, dict->ents[i].key);
+				value_release(vm, &dict->ents[i].value);
+			}
+		}
+		vm->array_elems -= dict->count;
+		free(dict->ents);
+		free(dict);
+	}
+}
+
 static void
 var_init(tbvm *vm)
 {
@@ -1254,10 +1835,12 @@ var_init(tbvm *vm)
 	for (i = 0; i < SVAR_BASE; i++) {
 		value_release_and_init(vm, &vm->vars[i], VALUE_TYPE_NUMBER);
 		var_release_array(vm, i);
+		var_release_dict(vm, i);
 	}
 	for (; i < NUM_VARS; i++) {
 		value_release_and_init(vm, &vm->vars[i], VALUE_TYPE_STRING);
 		var_release_array(vm, i);
+		var_release_dict(vm, i);
 	}
 }
 
@@ -1387,9 +1970,18 @@ static const struct tbvm_file_io default_file_io = {
 static void
 reset_stacks(tbvm *vm)
 {
+	if (vm->expr_rec != NULL) {
+		/*
+		 * The recording was cut short by an error or BREAK, not
+		 * by something that can't be compiled; forget the entry
+		 * so that the expression is recorded again next time.
+		 */
+		vm->expr_rec->lineno = 0;
+		vm->expr_rec = NULL;
+	}
 	vm->ondone = 0;
 	vm->cstk_ptr = 0;
-	vm->sbrstk_ptr = 0;
+	sbrstk_unwind(vm, 0);
 	aestk_reset(vm);
 }
 
@@ -1398,6 +1990,9 @@ direct_mode(tbvm *vm, int ptr)
 {
 	reset_stacks(vm);
 
+	if (! vm->direct) {
+		vm_trace_direct(vm);
+	}
 	vm->direct = true;
 	vm->pc = vm->collector_pc;
 	vm->lineno = 0;
@@ -1441,12 +2036,58 @@ skip_whitespace(tbvm *vm)
 	skip_whitespace_buf(vm->lbuf, &vm->lbuf_ptr);
 }
 
-static void
-progstore_init(tbvm *vm)
+/*
+ * Return a pointer to the end-of-line at or after cp.  Lines are
+ * always terminated and never longer than SIZE_LBUF, and memchr()
+ * stops at the first match, so this lets libc do the search with
+ * whatever vector instructions the CPU has.
+ */
+static char *
+find_eol(char *cp)
 {
-	int i;
+	return memchr(cp, END_OF_LINE, SIZE_LBUF);
+}
 
-	for (i = 0; i < MAX_LINENO; i++) {
+static void
+tst_cache_flush(tbvm *vm)
+{
+	memset(vm->tst_cache, 0, sizeof(vm->tst_cache));
+	vm->tst_fill = NULL;
+}
+
+static void
+expr_cache_flush(tbvm *vm)
+{
+	int i;
+
+	for (i = 0; i < SIZE_EXPR_CACHE; i++) {
+		free(vm->expr_cache[i].ops);
+	}
+	memset(vm->expr_cache, 0, sizeof(vm->expr_cache));
+	vm->expr_rec = NULL;
+}
+
+static void
+data_index_flush(tbvm *vm)
+{
+	free(vm->data_items);
+	vm->data_indexed = false;
+	vm->data_items = NULL;
+	vm->ndata_items = 0;
+	vm->data_item_next = 0;
+}
+
+static void
+progstore_init(tbvm *vm)
+{
+	int i;
+
+	tst_cache_flush(vm);
+	expr_cache_flush(vm);
+	data_index_flush(vm);
+	string_intern_flush(vm);
+
+	for (i = 0; i < MAX_LINENO; i++) {
 		if (vm->progstore[i] != NULL) {
 			free(vm->progstore[i]);
 			vm->progstore[i] = NULL;
@@ -1522,9 +2163,7 @@ insert_line(tbvm *vm, int lineno)
 	assert(vm->lbuf == vm->direct_lbuf);
 
 	skip_whitespace(vm);
-	for (cp = &vm->lbuf[vm->lbuf_ptr]; *cp != END_OF_LINE; cp++) {
-		/* skip to end of line */
-	}
+	cp = find_eol(&vm->lbuf[vm->lbuf_ptr]);
 	len = cp - &vm->lbuf[vm->lbuf_ptr];
 	if (len == 0) {
 		cp = NULL;		/* delete line */
@@ -1538,6 +2177,10 @@ insert_line(tbvm *vm, int lineno)
 	}
 	vm->progstore[i] = cp;
 	update_bookends(vm, lineno, cp);
+	tst_cache_flush(vm);
+	expr_cache_flush(vm);
+	data_index_flush(vm);
+	string_intern_flush(vm);
 	string_invalidate_all_static(vm);
 }
 
@@ -1573,9 +2216,8 @@ list_program(tbvm *vm, int firstline, int lastline)
 		}
 		print_cstring(vm, format_integer(i + 1, width, vm->tmp_buf));
 		vm_cons_putchar(vm, ' ');
-		for (cp = vm->progstore[i]; *cp != END_OF_LINE; cp++) {
-			vm_cons_putchar(vm, *cp);
-		}
+		cp = vm->progstore[i];
+		print_strbuf(vm, cp, find_eol(cp) - cp);
 		print_crlf(vm);
 	}
 }
@@ -1733,6 +2375,7 @@ set_line_ext(tbvm *vm, int lineno, int ptr, bool fatal, bool restoring)
 	vm->lineno = lineno;
 	if (!restoring) {
 		vm->pc = vm->executor_pc;
+		vm_trace_line(vm, lineno);
 	}
 }
 
@@ -1760,12 +2403,14 @@ next_statement(tbvm *vm)
 	}
 }
 
+/*
+ * tbvm_set_prog() only accepts programs that pass verify_prog(), so
+ * the program counter can't leave the program and fetches need no
+ * bounds checks.
+ */
 static unsigned char
 get_progbyte(tbvm *vm)
 {
-	if (vm->pc < 0 || vm->pc >= vm->vm_progsize) {
-		vm_abort(vm, "!VM PROGRAM COUNTER OUT OF RANGE");
-	}
 	return vm->vm_prog[vm->pc++];
 }
 
@@ -1776,13 +2421,37 @@ get_opcode(tbvm *vm)
 	return get_progbyte(vm);
 }
 
+/*
+ * Rewrite the opcode of the current instruction.  Operands are never
+ * touched, so the program remains one that verify_prog() accepts once
+ * quickened opcodes are mapped back to their generic versions.
+ */
+static void
+quicken(tbvm *vm, unsigned char opc)
+{
+	vm->vm_prog[vm->opc_pc] = opc;
+}
+
+static unsigned int
+decode_label(const char *cp, unsigned int lblsize)
+{
+	const unsigned char *ucp = (const unsigned char *)cp;
+	unsigned int val;
+
+	val = ucp[0] | (ucp[1] << 8);
+	if (lblsize == OPC_LBL_SIZE_WIDE) {
+		val |= (ucp[2] << 16) | ((unsigned int)ucp[3] << 24);
+	}
+	return val;
+}
+
 static int
 get_label(tbvm *vm)
 {
 	int tmp;
 
-	tmp  = get_progbyte(vm);
-	tmp |= get_progbyte(vm) << 8;
+	tmp = decode_label(&vm->vm_prog[vm->pc], vm->vm_lblsize);
+	vm->pc += vm->vm_lblsize;
 
 	return tmp;
 }
@@ -1815,7 +2484,38 @@ peek_linebyte(tbvm *vm, int idx)
 
 typedef void (*opc_impl_func_t)(tbvm *);
 
+/*
+ * Quickened opcodes.  These never appear in a VM program image.  When
+ * ADD, SUB, MUL, DIV, CMPR or CMPRX finds that its operands are both
+ * numbers (or both strings), it rewrites its own opcode in the VM's
+ * copy of the program to the version specialized for those types.
+ * The specialized version checks the types in place on the AESTK and,
+ * if they have changed, rewrites the opcode back and runs the generic
+ * version instead (which may in turn quicken to another version).
+ */
+#define	OPC_Q_ADDN	(OPC___COUNT + 0)
+#define	OPC_Q_ADDS	(OPC___COUNT + 1)
+#define	OPC_Q_SUBN	(OPC___COUNT + 2)
+#define	OPC_Q_MULN	(OPC___COUNT + 3)
+#define	OPC_Q_DIVN	(OPC___COUNT + 4)
+#define	OPC_Q_CMPRN	(OPC___COUNT + 5)
+#define	OPC_Q_CMPRS	(OPC___COUNT + 6)
+#define	OPC_Q_CMPRXN	(OPC___COUNT + 7)
+#define	OPC_Q_CMPRXS	(OPC___COUNT + 8)
+
+#define	OPC_Q___LAST	OPC_Q_CMPRXS
+#define	OPC_Q___COUNT	(OPC_Q___LAST + 1)
+
+#ifdef TBVM_CONFIG_COMPILED_PROGRAM
+/*
+ * Each opcode is called from many places in the compiled program;
+ * keep them out-of-line to keep it small.
+ */
+#define	IMPL(x)	static void __attribute__((__noinline__))		\
+		OPC_ ## x ## _impl(tbvm *vm)
+#else
 #define	IMPL(x)	static void OPC_ ## x ## _impl(tbvm *vm)
+#endif /* TBVM_CONFIG_COMPILED_PROGRAM */
 
 /*
  * Delete leading blanks.  If string matches the BASIC line, advance
@@ -1835,7 +2535,8 @@ IMPL(TST)
 		line_c = peek_linebyte(vm, count);
 		if ((prog_c & 0x7f) != line_c) {
 			vm->pc = label;
-			return;
+			count = 0;
+			break;
 		}
 		count++;
 		if (prog_c & 0x80) {
@@ -1843,28 +2544,158 @@ IMPL(TST)
 		}
 	}
 	advance_cursor(vm, count);
+
+	/*
+	 * If this TST immediately follows XINIT, MEMO, or another TST
+	 * in the chain, extend the TST cache entry.
+	 */
+	if (vm->tst_fill != NULL) {
+		if (vm->opc_pc == vm->tst_fill_pc) {
+			vm->tst_fill->pc = vm->tst_fill_pc = vm->pc;
+			vm->tst_fill->tst_lbuf_ptr = vm->lbuf_ptr;
+		} else {
+			vm->tst_fill = NULL;
+		}
+	}
+}
+
+static struct tst_cache *
+tst_cache_entry(tbvm *vm, unsigned int pc)
+{
+	return &vm->tst_cache[(vm->lineno * 31 + vm->lbuf_ptr +
+	    pc * 7) & (SIZE_TST_CACHE - 1)];
+}
+
+static bool
+tst_cache_hit_p(tbvm *vm, const struct tst_cache *ent, unsigned int pc)
+{
+	return ent->lineno == vm->lineno && ent->lbuf_ptr == vm->lbuf_ptr &&
+	    ent->chain_pc == pc;
+}
+
+/*
+ * Coverage and the performance counters are charged per VM insn, so
+ * anything that skips over insns is turned off while they're running.
+ */
+static bool
+insn_counting_p(tbvm *vm)
+{
+	return vm->cov != NULL || vm->perf_io != NULL;
+}
+
+/*
+ * Skip the chain of TSTs that follows if it has already been run at
+ * this position in this line.  Otherwise, have the TSTs record where
+ * they end up.  Only stored lines are cached.
+ */
+static void
+tst_memo(tbvm *vm)
+{
+	struct tst_cache *ent;
+
+	vm->tst_fill = NULL;
+	if (vm->direct || insn_counting_p(vm)) {
+		return;
+	}
+
+	ent = tst_cache_entry(vm, vm->pc);
+	if (tst_cache_hit_p(vm, ent, vm->pc)) {
+		vm->pc = ent->pc;
+		vm->lbuf_ptr = ent->tst_lbuf_ptr;
+		return;
+	}
+
+	ent->lineno = vm->lineno;
+	ent->lbuf_ptr = ent->tst_lbuf_ptr = vm->lbuf_ptr;
+	ent->chain_pc = ent->pc = vm->tst_fill_pc = vm->pc;
+	vm->tst_fill = ent;
+}
+
+/*
+ * Memoize the outcome of the TST chain that follows (see above).
+ */
+IMPL(MEMO)
+{
+	tst_memo(vm);
+}
+
+/*
+ * At the start of EXPR: if the expression at the cursor has been
+ * compiled, evaluate it and return from EXPR.  Otherwise, start
+ * recording it, unless an enclosing expression is being recorded.
+ * Compiled expressions run their insns directly, so they aren't
+ * used while insns are being counted.
+ */
+IMPL(CEXPR)
+{
+	struct expr_cache *ent;
+
+	if (vm->direct || vm->expr_rec != NULL || insn_counting_p(vm)) {
+		return;
+	}
+
+	ent = &vm->expr_cache[(vm->lineno * 31 + vm->lbuf_ptr) &
+	    (SIZE_EXPR_CACHE - 1)];
+	if (ent->lineno == vm->lineno && ent->lbuf_ptr == vm->lbuf_ptr) {
+		if (ent->ops != NULL) {
+			expr_run(vm, ent);
+			vm->lbuf_ptr = ent->end_lbuf_ptr;
+			vm->pc = cstk_pop(vm);
+		}
+		return;
+	}
+
+	free(ent->ops);
+	ent->lineno = vm->lineno;
+	ent->lbuf_ptr = vm->lbuf_ptr;
+	ent->ops = NULL;
+	ent->nops = 0;
+	vm->expr_rec = ent;
+	vm->expr_rec_depth = vm->cstk_ptr;
+	vm->expr_rec_nops = 0;
 }
 
 /*
  * This is a lot like TST, except we scan forward looking for the string
  * to match.  If we encounter an immediate string, we skip over it, and
  * keep scanning after.
+ *
+ * Like a TST chain, the outcome depends only on the program text, so
+ * in stored lines it's remembered in the TST cache (keyed by the PC
+ * of the SCAN).  This saves re-scanning for ELSE every time an IF is
+ * false.  As with the TST chain memo, the cache isn't used while insns
+ * are being counted, so the counters see the full cost of the scan.
  */
 IMPL(SCAN)
 {
+	struct tst_cache *ent = NULL;
 	int label = get_label(vm);
 	int count, saved_pc = vm->pc;
 	char line_c, prog_c;
 	bool matching = false;
 	bool dquote = false;
 
+	if (! vm->direct && ! insn_counting_p(vm)) {
+		ent = tst_cache_entry(vm, vm->opc_pc);
+		if (tst_cache_hit_p(vm, ent, vm->opc_pc)) {
+			vm->pc = ent->pc;
+			vm->lbuf_ptr = ent->tst_lbuf_ptr;
+			return;
+		}
+		vm->tst_fill = NULL;
+		ent->lineno = vm->lineno;
+		ent->lbuf_ptr = vm->lbuf_ptr;
+		ent->chain_pc = vm->opc_pc;
+	}
+
 	skip_whitespace(vm);
 
 	for (count = 0, prog_c = get_progbyte(vm);;) {
 		line_c = peek_linebyte(vm, count);
 		if (line_c == END_OF_LINE) {
 			vm->pc = label;
-			return;
+			count = 0;
+			break;
 		}
 		count++;
 		if (line_c == DQUOTE) {
@@ -1886,15 +2717,37 @@ IMPL(SCAN)
 		}
 	}
 	advance_cursor(vm, count);
+
+	if (ent != NULL) {
+		ent->pc = vm->pc;
+		ent->tst_lbuf_ptr = vm->lbuf_ptr;
+	}
 }
 
 /*
- * Advance the cursor to the current end-of-line.
+ * Advance the cursor to the current end-of-line.  This is remembered
+ * in the TST cache, too.
  */
 IMPL(ADVEOL)
 {
-	while (vm->lbuf[vm->lbuf_ptr] != END_OF_LINE) {
-		vm->lbuf_ptr++;
+	struct tst_cache *ent = NULL;
+
+	if (! vm->direct && ! insn_counting_p(vm)) {
+		ent = tst_cache_entry(vm, vm->opc_pc);
+		if (tst_cache_hit_p(vm, ent, vm->opc_pc)) {
+			vm->lbuf_ptr = ent->tst_lbuf_ptr;
+			return;
+		}
+		vm->tst_fill = NULL;
+		ent->lineno = vm->lineno;
+		ent->lbuf_ptr = vm->lbuf_ptr;
+		ent->chain_pc = ent->pc = vm->opc_pc;
+	}
+
+	vm->lbuf_ptr = find_eol(&vm->lbuf[vm->lbuf_ptr]) - vm->lbuf;
+
+	if (ent != NULL) {
+		ent->tst_lbuf_ptr = vm->lbuf_ptr;
 	}
 }
 
@@ -2141,12 +2994,67 @@ IMPL(RSTR)
 	restore_line(vm, subr.lineno, subr.lbuf_ptr);
 }
 
-bool
-compare(tbvm *vm)
+/*
+ * Relation values:
+ *
+ * 0	=
+ * 1	<
+ * 2	<=
+ * 3	<>
+ * 4	>
+ * 5	>=
+ *
+ * Each is the set of orderings of the two operands for which the
+ * relation holds.
+ */
+#define	REL_LT		0x01
+#define	REL_EQ		0x02
+#define	REL_GT		0x04
+#define	REL_NRELS	6
+
+static const unsigned char rel_orderings[REL_NRELS] = {
+	REL_EQ,
+	REL_LT,
+	REL_LT | REL_EQ,
+	REL_LT | REL_GT,
+	REL_GT,
+	REL_GT | REL_EQ,
+};
+
+static inline bool
+compare_numbers(unsigned int rel, tbvm_number num1, tbvm_number num2)
+{
+	return (rel_orderings[rel] &
+	    (num1 < num2 ? REL_LT : num1 == num2 ? REL_EQ : REL_GT)) != 0;
+}
+
+static inline bool
+compare_strings(unsigned int rel, string *str1, string *str2)
+{
+	int cmp;
+
+	if (rel_orderings[rel] == REL_EQ) {
+		return string_equal_p(str1, str2);
+	}
+	if (rel_orderings[rel] == (REL_LT | REL_GT)) {
+		return ! string_equal_p(str1, str2);
+	}
+
+	cmp = string_compare(str1, str2);
+	return (rel_orderings[rel] &
+	    (cmp < 0 ? REL_LT : cmp == 0 ? REL_EQ : REL_GT)) != 0;
+}
+
+/*
+ * Generic comparison of AESTK(SP-2) with AESTK(SP).  Quickens the
+ * current instruction to qopc_num or qopc_str for the operand types.
+ */
+static bool
+compare(tbvm *vm, unsigned char qopc_num, unsigned char qopc_str)
 {
 	struct value val1, val2;
-	int rel;
-	bool result = false;
+	unsigned int rel;
+	bool result;
 
 	aestk_pop_value(vm, VALUE_TYPE_ANY, &val2);
 	rel = number_to_int(vm, aestk_pop_number(vm));
@@ -2161,70 +3069,50 @@ compare(tbvm *vm)
 	    val1.type != val2.type) {
 		basic_wrong_type_error(vm);
 	}
-
-	/*
-	 * Relation values:
-	 *
-	 * 0	=
-	 * 1	<
-	 * 2	<=
-	 * 3	<>
-	 * 4	>
-	 * 5	>=
-	 */
-	switch (rel) {
-	case 0:
-		if (val1.type == VALUE_TYPE_STRING) {
-			result = string_compare(val1.string, val2.string) == 0;
-		} else {
-			result = val1.number == val2.number;
-		}
-		break;
-	
-	case 1:
-		if (val1.type == VALUE_TYPE_STRING) {
-			result = string_compare(val1.string, val2.string) < 0;
-		} else {
-			result = val1.number < val2.number;
-		}
-		break;
-	
-	case 2:
-		if (val1.type == VALUE_TYPE_STRING) {
-			result = string_compare(val1.string, val2.string) <= 0;
-		} else {
-			result = val1.number <= val2.number;
-		}
-		break;
-	
-	case 3:
-		if (val1.type == VALUE_TYPE_STRING) {
-			result = string_compare(val1.string, val2.string) != 0;
-		} else {
-			result = val1.number != val2.number;
-		}
-		break;
-	
-	case 4:
-		if (val1.type == VALUE_TYPE_STRING) {
-			result = string_compare(val1.string, val2.string) > 0;
-		} else {
-			result = val1.number > val2.number;
-		}
-		break;
-	
-	case 5:
-		if (val1.type == VALUE_TYPE_STRING) {
-			result = string_compare(val1.string, val2.string) >= 0;
-		} else {
-			result = val1.number >= val2.number;
-		}
-		break;
-	
-	default:
+	if (rel >= REL_NRELS) {
 		vm_abort(vm, "!INVALID RELATIONAL OPERATOR");
 	}
 
+	if (val1.type == VALUE_TYPE_STRING) {
+		result = compare_strings(rel, val1.string, val2.string);
+		quicken(vm, qopc_str);
+	} else {
+		result = compare_numbers(rel, val1.number, val2.number);
+		quicken(vm, qopc_num);
+	}
+
+	return result;
+}
+
+/*
+ * Quickened comparison of AESTK(SP-2) with AESTK(SP), which are both
+ * of the specified type.  Returns -1 if the operands are not what the
+ * instruction was quickened for.
+ */
+static int
+compare_quick(tbvm *vm, int type)
+{
+	struct value *vals;
+	unsigned int rel;
+	bool result;
+
+	if (vm->aestk_ptr < 3) {
+		return -1;
+	}
+	vals = &vm->aestk[vm->aestk_ptr - 3];
+	if (vals[0].type != type || vals[2].type != type ||
+	    vals[1].type != VALUE_TYPE_NUMBER ||
+	    (rel = number_to_int(vm, vals[1].number)) >= REL_NRELS) {
+		return -1;
+	}
+
+	if (type == VALUE_TYPE_NUMBER) {
+		vm->aestk_ptr -= 3;
+		return compare_numbers(rel, vals[0].number, vals[2].number);
+	}
+
+	result = compare_strings(rel, vals[0].string, vals[2].string);
+	aestk_popn(vm, 3);
 	return result;
 }
 
@@ -2236,11 +3124,34 @@ compare(tbvm *vm)
  */
 IMPL(CMPR)
 {
-	if (! compare(vm)) {
+	if (! compare(vm, OPC_Q_CMPRN, OPC_Q_CMPRS)) {
+		next_statement(vm);
+	}
+}
+
+static void
+cmpr_quick(tbvm *vm, int type)
+{
+	int result = compare_quick(vm, type);
+
+	if (result == -1) {
+		quicken(vm, OPC_CMPR);
+		OPC_CMPR_impl(vm);
+	} else if (! result) {
 		next_statement(vm);
 	}
 }
 
+IMPL(Q_CMPRN)
+{
+	cmpr_quick(vm, VALUE_TYPE_NUMBER);
+}
+
+IMPL(Q_CMPRS)
+{
+	cmpr_quick(vm, VALUE_TYPE_STRING);
+}
+
 /*
  * This is like CMPR, but on no match, CMPRX branches to a VM label
  * rather than performing NXT.
@@ -2249,11 +3160,39 @@ IMPL(CMPRX)
 {
 	int label = get_label(vm);
 
-	if (! compare(vm)) {
+	if (! compare(vm, OPC_Q_CMPRXN, OPC_Q_CMPRXS)) {
+		vm->pc = label;
+	}
+}
+
+static void
+cmprx_quick(tbvm *vm, int type)
+{
+	int result = compare_quick(vm, type);
+	int label;
+
+	if (result == -1) {
+		quicken(vm, OPC_CMPRX);
+		OPC_CMPRX_impl(vm);
+		return;
+	}
+
+	label = get_label(vm);
+	if (! result) {
 		vm->pc = label;
 	}
 }
 
+IMPL(Q_CMPRXN)
+{
+	cmprx_quick(vm, VALUE_TYPE_NUMBER);
+}
+
+IMPL(Q_CMPRXS)
+{
+	cmprx_quick(vm, VALUE_TYPE_STRING);
+}
+
 /*
  * Push the number num onto the AESTK.
  */
@@ -2492,12 +3431,14 @@ IMPL(ADD)
 
 	switch (val1.type) {
 	case VALUE_TYPE_NUMBER:
+		quicken(vm, OPC_Q_ADDN);
 		res = val1.number + val2.number;
 		aestk_push_number(vm, res);
 		check_math_error(vm, res);
 		break;
 
 	case VALUE_TYPE_STRING:
+		quicken(vm, OPC_Q_ADDS);
 		aestk_push_string(vm,
 		    string_concatenate(vm, val1.string, val2.string));
 		break;
@@ -2507,6 +3448,54 @@ IMPL(ADD)
 	}
 }
 
+/*
+ * Returns the two operands on top of the AESTK for a quickened
+ * instruction, or NULL if they are not both of the specified type.
+ */
+static struct value *
+aestk_peek2(tbvm *vm, int type)
+{
+	struct value *vals;
+
+	if (vm->aestk_ptr < 2) {
+		return NULL;
+	}
+	vals = &vm->aestk[vm->aestk_ptr - 2];
+	if (vals[0].type != type || vals[1].type != type) {
+		return NULL;
+	}
+	return vals;
+}
+
+IMPL(Q_ADDN)
+{
+	struct value *vals = aestk_peek2(vm, VALUE_TYPE_NUMBER);
+
+	if (vals == NULL) {
+		quicken(vm, OPC_ADD);
+		OPC_ADD_impl(vm);
+		return;
+	}
+	vals[0].number += vals[1].number;
+	vm->aestk_ptr--;
+	check_math_error(vm, vals[0].number);
+}
+
+IMPL(Q_ADDS)
+{
+	struct value val1, val2;
+
+	if (aestk_peek2(vm, VALUE_TYPE_STRING) == NULL) {
+		quicken(vm, OPC_ADD);
+		OPC_ADD_impl(vm);
+		return;
+	}
+	aestk_pop_value(vm, VALUE_TYPE_STRING, &val2);
+	aestk_pop_value(vm, VALUE_TYPE_STRING, &val1);
+	aestk_push_string(vm,
+	    string_concatenate(vm, val1.string, val2.string));
+}
+
 /*
  * Replace top two elements of AESTK by their
  * difference.
@@ -2516,10 +3505,25 @@ IMPL(SUB)
 	tbvm_number num2 = aestk_pop_number(vm);
 	tbvm_number num1 = aestk_pop_number(vm);
 	tbvm_number val = num1 - num2;
+	quicken(vm, OPC_Q_SUBN);
 	aestk_push_number(vm, val);
 	check_math_error(vm, val);
 }
 
+IMPL(Q_SUBN)
+{
+	struct value *vals = aestk_peek2(vm, VALUE_TYPE_NUMBER);
+
+	if (vals == NULL) {
+		quicken(vm, OPC_SUB);
+		OPC_SUB_impl(vm);
+		return;
+	}
+	vals[0].number -= vals[1].number;
+	vm->aestk_ptr--;
+	check_math_error(vm, vals[0].number);
+}
+
 /*
  * Replace top of AESTK with its negative.
  */
@@ -2538,10 +3542,25 @@ IMPL(MUL)
 	tbvm_number num2 = aestk_pop_number(vm);
 	tbvm_number num1 = aestk_pop_number(vm);
 	tbvm_number val = num1 * num2;
+	quicken(vm, OPC_Q_MULN);
 	aestk_push_number(vm, val);
 	check_math_error(vm, val);
 }
 
+IMPL(Q_MULN)
+{
+	struct value *vals = aestk_peek2(vm, VALUE_TYPE_NUMBER);
+
+	if (vals == NULL) {
+		quicken(vm, OPC_MUL);
+		OPC_MUL_impl(vm);
+		return;
+	}
+	vals[0].number *= vals[1].number;
+	vm->aestk_ptr--;
+	check_math_error(vm, vals[0].number);
+}
+
 /*
  * Replace top two elements of AESTK by their exponentiation.
  */
@@ -2562,10 +3581,25 @@ IMPL(DIV)
 	tbvm_number num2 = aestk_pop_number(vm);
 	tbvm_number num1 = aestk_pop_number(vm);
 	tbvm_number val = tbvm_div(vm, num1, num2);
+	quicken(vm, OPC_Q_DIVN);
 	aestk_push_number(vm, val);
 	check_math_error(vm, val);
 }
 
+IMPL(Q_DIVN)
+{
+	struct value *vals = aestk_peek2(vm, VALUE_TYPE_NUMBER);
+
+	if (vals == NULL) {
+		quicken(vm, OPC_DIV);
+		OPC_DIV_impl(vm);
+		return;
+	}
+	vm->aestk_ptr--;
+	vals[0].number = tbvm_div(vm, vals[0].number, vals[1].number);
+	check_math_error(vm, vals[0].number);
+}
+
 /*
  * Replaces top two elements of AESTK by their modulus.
  */
@@ -2593,19 +3627,19 @@ IMPL(STORE)
 }
 
 /*
- * Store the DATA item at the program cursor into the varable
- * referenced on the stack.  The type if the DATA item is inferred
- * from the variable type.
+ * Find the extent of the DATA item at buf[ptr].  Returns false if
+ * the item is malformed.
  */
-IMPL(DSTORE)
+static bool
+data_item_scan(const char *buf, int ptr, struct data_item *item)
 {
-	var_ref var = aestk_pop_varref(vm);
-	char *cp0, *cp1;
+	const char *cp0, *cp1;
 	unsigned dquotes = 0;
 
-	skip_whitespace(vm);
+	item->lbuf_ptr = ptr;
+	skip_whitespace_buf(buf, &ptr);
 
-	cp0 = cp1 = &vm->lbuf[vm->lbuf_ptr];
+	cp0 = cp1 = &buf[ptr];
 
 	/* find the separator or the end-of-line. */
 	for (;; cp1++) {
@@ -2617,7 +3651,7 @@ IMPL(DSTORE)
 					 * the beginning of the DATA item.
 					 */
 					if (cp1 != cp0) {
-						basic_syntax_error(vm);
+						return false;
 					}
 					/* Advance over starting quote. */
 					cp0++;
@@ -2625,7 +3659,7 @@ IMPL(DSTORE)
 				dquotes++;
 				continue;
 			}
-			basic_syntax_error(vm);
+			return false;
 		}
 		if (*cp1 == COMMA) {
 			if (dquotes == 1) {
@@ -2637,14 +3671,14 @@ IMPL(DSTORE)
 		if (*cp1 == END_OF_LINE) {
 			if (dquotes == 1) {
 				/* EOL inside quote is an error. */
-				basic_syntax_error(vm);
+				return false;
 			}
 			break;
 		}
 	}
 
-	/* total length is how much we advance the cursor. */
-	advance_cursor(vm, cp1 - &vm->lbuf[vm->lbuf_ptr]);
+	/* this is where the cursor ends up. */
+	item->end_lbuf_ptr = cp1 - buf;
 
 	/* trim trailing whitespace */
 	while (cp1 != cp0) {
@@ -2663,7 +3697,22 @@ IMPL(DSTORE)
 	}
 
 	/* Now we know the length of the string we care about. */
-	string *string = string_alloc(vm, cp0, cp1 - cp0, vm->lineno);
+	item->str_ptr = cp0 - buf;
+	item->str_len = cp1 - cp0;
+	item->quoted = dquotes != 0;
+	return true;
+}
+
+/*
+ * Store a DATA item from the line in buf into a variable.  The type
+ * of the DATA item is inferred from the variable type.
+ */
+static void
+data_item_store(tbvm *vm, var_ref var, char *buf, int lineno,
+    const struct data_item *item)
+{
+	string *string = string_alloc(vm, &buf[item->str_ptr],
+	    item->str_len, lineno);
 
 	/* If we're storing into a numeric var, convert to a number. */
 	if (var_type(vm, var) == VALUE_TYPE_NUMBER) {
@@ -2676,7 +3725,7 @@ IMPL(DSTORE)
 		 * If it's a quoted string, then flag as the
 		 * wrong type.
 		 */
-		if (dquotes) {
+		if (item->quoted) {
 			basic_wrong_type_error(vm);
 		}
 
@@ -2696,6 +3745,23 @@ IMPL(DSTORE)
 	}
 }
 
+/*
+ * Store the DATA item at the program cursor into the varable
+ * referenced on the stack.  The type if the DATA item is inferred
+ * from the variable type.
+ */
+IMPL(DSTORE)
+{
+	var_ref var = aestk_pop_varref(vm);
+	struct data_item item;
+
+	if (! data_item_scan(vm->lbuf, vm->lbuf_ptr, &item)) {
+		basic_syntax_error(vm);
+	}
+	vm->lbuf_ptr = item.end_lbuf_ptr;
+	data_item_store(vm, var, vm->lbuf, vm->lineno, &item);
+}
+
 /*
  * Test for variable (i.e letter) if present. Place its index value
  * onto the AESTK and continue execution at next suggested location.
@@ -2878,9 +3944,11 @@ IMPL(GETLINE)
 				/* Finished loading a program. */
 				prog_file_fini(vm);
 			}
+			limits_reset(vm);
 			return;
 		}
 		if (check_input_eol(vm, ch, vm->lbuf, &vm->lbuf_ptr)) {
+			limits_reset(vm);
 			return;
 		}
 		if (check_input_too_long(vm, &vm->lbuf_ptr)) {
@@ -2948,7 +4016,7 @@ get_prog_filename(tbvm *vm)
 		break;
 
 	case VALUE_TYPE_STRING:
-		filename = value.string;
+		filename = string_terminate(vm, value.string);
 		break;
 
 	default:
@@ -3039,6 +4107,7 @@ IMPL(XINIT)
 		basic_syntax_error(vm);
 	}
 	aestk_reset(vm);
+	tst_memo(vm);
 }
 
 /*
@@ -3266,6 +4335,7 @@ IMPL(TSTS)
 {
 	int label = get_label(vm);
 	int i;
+	char *cp, *eol;
 	string *string;
 
 	skip_whitespace(vm);
@@ -3277,14 +4347,15 @@ IMPL(TSTS)
 	advance_cursor(vm, 1);		/* advance past DQUOTE */
 
 	/* Find the end of the string. */
-	for (i = 0; peek_linebyte(vm, i) != DQUOTE; i++) {
-		if (peek_linebyte(vm, i) == END_OF_LINE) {
-			basic_syntax_error(vm);
-		}
+	cp = &vm->lbuf[vm->lbuf_ptr];
+	eol = find_eol(cp);
+	if ((cp = memchr(cp, DQUOTE, eol - cp)) == NULL) {
+		basic_syntax_error(vm);
 	}
+	i = cp - &vm->lbuf[vm->lbuf_ptr];
 
 	/* Create the string object and push it onto the stack. */
-	string = string_alloc(vm, &vm->lbuf[vm->lbuf_ptr], i, vm->lineno);
+	string = string_intern(vm, &vm->lbuf[vm->lbuf_ptr], i);
 	aestk_push_string(vm, string);
 
 	advance_cursor(vm, i + 1);	/* advance past DQUOTE */
@@ -3407,9 +4478,7 @@ IMPL(CHR)
 	}
 	int code = (int)val;
 
-	string *string = string_alloc(vm, NULL, 1, 0);
-	string->str[0] = (unsigned char)code;
-	aestk_push_string(vm, string);
+	aestk_push_string(vm, string_char((unsigned char)code));
 }
 
 /*
@@ -3603,6 +4672,11 @@ IMPL(MKS)
 		basic_wrong_type_error(vm);
 	}
 
+	if (count == 1) {
+		aestk_push_string(vm, string_char((unsigned char)ch));
+		return;
+	}
+
 	string *string = string_alloc(vm, NULL, count, 0);
 	for (int i = 0; i < count; i++) {
 		string->str[i] = ch;
@@ -3674,12 +4748,19 @@ IMPL(SBSTR)
 		vm_abort(vm, "!ILLEGAL SBSTR MODE");
 	}
 
+	/* Don't run off the end of the string. */
+	if (pos >= string->len) {
+		len = 0;
+	} else if (len > string->len - pos) {
+		len = string->len - pos;
+	}
+
 	if (len == 0) {
 		aestk_push_string(vm, &empty_string);
 		return;
 	}
 
-	newstr = string_alloc(vm, &string->str[pos], len, string->lineno);
+	newstr = string_slice(vm, string, pos, len);
 	aestk_push_string(vm, newstr);
 }
 
@@ -3745,6 +4826,187 @@ IMPL(DMODE)
 	}
 }
 
+/*
+ * Scan the program for DATA statements and record the items in them.
+ * If items is NULL, just count them.
+ */
+static unsigned int
+data_index_scan(tbvm *vm, struct data_item *items)
+{
+	struct data_item item;
+	unsigned int n = 0;
+	char *buf, *cp;
+	int lineno, ptr;
+
+	for (lineno = vm->first_line;
+	     lineno != 0 && lineno <= vm->last_line; lineno++) {
+		if ((buf = find_line(vm, lineno)) == NULL) {
+			continue;
+		}
+		ptr = 0;
+		skip_whitespace_buf(buf, &ptr);
+		if (strncmp(&buf[ptr], "DATA", 4) != 0) {
+			continue;
+		}
+		ptr += 4;
+
+		for (;;) {
+			memset(&item, 0, sizeof(item));
+			item.lineno = lineno;
+			if (! data_item_scan(buf, ptr, &item)) {
+				/* READ reports the error when it gets here. */
+				item.lbuf_ptr = ptr;
+				item.end_lbuf_ptr = -1;
+			} else if (! item.quoted) {
+				memcpy(vm->tmp_buf, &buf[item.str_ptr],
+				    item.str_len);
+				vm->tmp_buf[item.str_len] = '\0';
+				item.numeric = tbvm_strtonum(vm->tmp_buf, &cp,
+				    &item.number) && *cp == '\0';
+			}
+			if (items != NULL) {
+				items[n] = item;
+			}
+			n++;
+			if (item.end_lbuf_ptr == -1 ||
+			    buf[item.end_lbuf_ptr] != COMMA) {
+				break;
+			}
+			ptr = item.end_lbuf_ptr + 1;
+		}
+	}
+	return n;
+}
+
+static void
+data_index_build(tbvm *vm)
+{
+	unsigned int n = data_index_scan(vm, NULL);
+
+	if (n != 0) {
+		vm->data_items = calloc(n, sizeof(*vm->data_items));
+		if (vm->data_items == NULL) {
+			basic_out_of_memory_error(vm);
+		}
+		data_index_scan(vm, vm->data_items);
+	}
+	vm->ndata_items = n;
+	vm->data_item_next = 0;
+	vm->data_indexed = true;
+}
+
+static bool
+data_item_after_pointer(tbvm *vm, const struct data_item *item)
+{
+	return item->lineno > vm->data_lineno ||
+	    (item->lineno == vm->data_lineno &&
+	     item->lbuf_ptr > vm->data_lbuf_ptr);
+}
+
+/*
+ * Return the first DATA item after the data pointer, or NULL if
+ * there are none.  This is usually the item after the one that
+ * was last read.
+ */
+static struct data_item *
+data_item_next(tbvm *vm)
+{
+	struct data_item *items;
+	unsigned int lo, hi, mid;
+
+	if (! vm->data_indexed) {
+		data_index_build(vm);
+	}
+	items = vm->data_items;
+
+	lo = vm->data_item_next;
+	if (lo < vm->ndata_items && data_item_after_pointer(vm, &items[lo]) &&
+	    (lo == 0 || ! data_item_after_pointer(vm, &items[lo - 1]))) {
+		return &items[lo];
+	}
+
+	for (lo = 0, hi = vm->ndata_items; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (data_item_after_pointer(vm, &items[mid])) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	vm->data_item_next = lo;
+	return lo < vm->ndata_items ? &items[lo] : NULL;
+}
+
+/*
+ * Store the next DATA item into the variable referenced on the stack
+ * and advance the data pointer past it.
+ */
+IMPL(DREAD)
+{
+	var_ref var = aestk_pop_varref(vm);
+	struct data_item *item;
+
+	if (vm->direct) {
+		basic_wrong_mode_error(vm);
+	}
+	if (vm->saved_lineno != 0) {
+		vm_abort(vm, "!NESTED ENTRY INTO DATA MODE");
+	}
+
+	if (vm->data_lineno == 0) {
+		vm->data_lineno = vm->first_line;
+		vm->data_lbuf_ptr = 0;
+	}
+	if ((item = data_item_next(vm)) == NULL) {
+		basic_out_of_data_error(vm);
+	}
+
+	if (item->end_lbuf_ptr == -1 ||
+	    (var_type(vm, var) == VALUE_TYPE_NUMBER && ! item->numeric)) {
+		/*
+		 * The item can't be stored.  Go into DATA mode at the
+		 * item so that the error is reported at the DATA line.
+		 */
+		vm->saved_lineno = vm->lineno;
+		vm->saved_lbuf_ptr = vm->lbuf_ptr;
+		set_line_ext(vm, item->lineno, item->lbuf_ptr, true, true);
+		if (item->end_lbuf_ptr == -1) {
+			basic_syntax_error(vm);
+		}
+		data_item_store(vm, var, vm->lbuf, vm->lineno, item);
+		vm_abort(vm, "!DATA ITEM INDEX INCONSISTENT");
+	}
+
+	if (var_type(vm, var) == VALUE_TYPE_NUMBER) {
+		var_set_number(vm, var, item->number);
+	} else {
+		data_item_store(vm, var, find_line(vm, item->lineno),
+		    item->lineno, item);
+	}
+
+	vm->data_lineno = item->lineno;
+	vm->data_lbuf_ptr = item->end_lbuf_ptr;
+	vm->data_item_next = (item - vm->data_items) + 1;
+}
+
+/*
+ * Set the data pointer to the beginning of the line number on the
+ * top of the stack.
+ */
+IMPL(DSEEK)
+{
+	int lineno = number_to_int(vm, aestk_pop_number(vm));
+
+	if (vm->saved_lineno != 0) {
+		vm_abort(vm, "!DATA RESET WHILE IN DATA MODE");
+	}
+	if (find_line(vm, lineno) == NULL) {
+		basic_missing_line_error(vm);
+	}
+	vm->data_lineno = lineno;
+	vm->data_lbuf_ptr = 0;
+}
+
 static bool
 array_get_dimensions(tbvm *vm, int *ndimp, var_ref *varp)
 {
@@ -3803,6 +5065,13 @@ alloc_array_elems(tbvm *vm, struct array *array, int totelem, int vtype)
 		/* Integer overflow. */
 		goto oom;
 	}
+	if (vm->limits.max_array_elems != 0 &&
+	    (vm->array_elems > vm->limits.max_array_elems ||
+	     (unsigned long)totelem >
+	     vm->limits.max_array_elems - vm->array_elems)) {
+		free(array);
+		basic_limit_error(vm, TBVM_LIMIT_ARRAY_ELEMS);
+	}
 
 	/* Pre-compute the size of each dimension index. */
 	for (dim = array->ndim - 1, idxsize = 1; dim >= 0; dim--) {
@@ -3812,6 +5081,7 @@ alloc_array_elems(tbvm *vm, struct array *array, int totelem, int vtype)
 
 	array->totelem = totelem;
 	array->elem = calloc(totelem, sizeof(*array->elem));
+	vm->array_elems += totelem;
 	for (i = 0; i < totelem; i++) {
 		value_release_and_init(vm, &array->elem[i], vtype);
 	}
@@ -3861,6 +5131,7 @@ IMPL(DIM)
 	}
 	alloc_array_elems(vm, array, totelem, vtype);
 	vm->array_vars[vidx] = array;
+	vm_trace_array(vm, vidx, totelem);
 
 	/* Now pop the arguments from the expression stack. */
 	aestk_popn(vm, ndim + 1);
@@ -3902,6 +5173,7 @@ IMPL(ARRY)
 		}
 		alloc_array_elems(vm, array, totelem, vtype);
 		vm->array_vars[vidx] = array;
+		vm_trace_array(vm, vidx, totelem);
 	}
 
 	if (ndim != array->ndim) {
@@ -3937,152 +5209,645 @@ IMPL(ARRY)
 }
 
 /*
- * Advance the cursor.  There are two modes:
- *
- * 0 - Advance the console cursor the specified number of columns.
- *
- * 1 - Advance the console cursor to the specified column (0-referenced).
- *     If the cursor is already at or beyond the specified column, it is
- *     not moved.
+ * Convert a dictionary key value to a string.  Numeric keys are
+ * converted as by STR$(), so A[1] and A["1"] are the same element.
  */
-IMPL(ADVCRS)
+static string *
+dict_key(tbvm *vm, struct value *keyval, unsigned int *hashp)
 {
-	int mode = get_literal(vm);
-	int val = number_to_int(vm, aestk_pop_number(vm));
+	string *key;
+	char *cp;
 
-	if (val < 0) {
-		basic_illegal_quantity_error(vm);
+	if (keyval->type == VALUE_TYPE_NUMBER) {
+		cp = format_number(keyval->number, vm->tmp_buf);
+		key = string_alloc(vm, cp, strlen(cp), 0);
+	} else {
+		key = keyval->string;
 	}
 
-	if (mode == 1) {
-		val = val > vm->cons_column ? val - vm->cons_column : 0;
+	/*
+	 * Static strings are re-pointed when the program is edited,
+	 * so we only cache the hash in the string when it's dynamic
+	 * (interned literals already have theirs).
+	 */
+	if (key->hash != 0) {
+		*hashp = key->hash;
+	} else {
+		*hashp = string_hash(key->str, key->len);
+		if (key->lineno == 0 && ! string_immortal_p(key)) {
+			key->hash = *hashp;
+		}
 	}
+	return key;
+}
 
-	while (val--) {
-		vm_cons_putchar(vm, ' ');
+static struct dict_ent *
+dict_lookup(struct dict *dict, string *key, unsigned int hash)
+{
+	struct dict_ent *ent;
+	unsigned int i, mask = dict->size - 1;
+
+	/* The table always has at least one empty slot. */
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		ent = &dict->ents[i];
+		if (ent->key == NULL) {
+			if (! ent->deleted) {
+				return NULL;
+			}
+		} else if (ent->hash == hash && string_equal_p(ent->key, key)) {
+			return ent;
+		}
 	}
+}
 
-	/* Just return an empty string so PRINT doesn't croak. */
-	aestk_push_string(vm, string_alloc(vm, NULL, 0, 0));
+static struct dict_ent *
+dict_find(tbvm *vm, int vidx, string *key, unsigned int hash)
+{
+	struct dict *dict = vm->dict_vars[vidx];
+
+	if (dict == NULL || dict->count == 0) {
+		return NULL;
+	}
+	return dict_lookup(dict, key, hash);
 }
 
 /*
- * Convert a string to all-upper-case or all-lower-case based
- * on mode:
- *
- * 0 - lower-case
- *
- * 1 - upper-case
+ * Re-hash the table into a new set of slots.  This also sweeps out
+ * any tombstones.
  */
-IMPL(UPRLWR)
+static void
+dict_resize(tbvm *vm, struct dict *dict, unsigned int size)
 {
-	int doup = get_literal(vm);
-	string *arg = aestk_pop_string(vm);
-	string *newstr = string_alloc(vm, arg->str, arg->len, 0);
-	int i;
+	struct dict_ent *oents = dict->ents, *ent;
+	unsigned int i, j, osize = dict->size;
 
-	if (doup) {
-		for (i = 0; i < newstr->len; i++) {
-			if (islower((unsigned char)newstr->str[i])) {
-				newstr->str[i] =
-				    toupper((unsigned char)newstr->str[i]);
-			}
+	if ((dict->ents = calloc(size, sizeof(*dict->ents))) == NULL) {
+		dict->ents = oents;
+		basic_out_of_memory_error(vm);
+	}
+	dict->size = size;
+	dict->used = dict->count;
+	dict->iter_idx = 0;
+
+	for (i = 0; i < osize; i++) {
+		if (oents[i].key == NULL) {
+			continue;
 		}
-	} else {
-		for (i = 0; i < newstr->len; i++) {
-			if (isupper((unsigned char)newstr->str[i])) {
-				newstr->str[i] =
-				    tolower((unsigned char)newstr->str[i]);
+		for (j = oents[i].hash & (size - 1);;
+		     j = (j + 1) & (size - 1)) {
+			ent = &dict->ents[j];
+			if (ent->key == NULL) {
+				*ent = oents[i];
+				break;
 			}
 		}
 	}
-	aestk_push_string(vm, newstr);
+	free(oents);
 }
 
-#undef IMPL
+/*
+ * Return the entry for key, creating it if necessary.
+ */
+static struct dict_ent *
+dict_insert(tbvm *vm, int vidx, int vtype, string *key, unsigned int hash)
+{
+	struct dict *dict;
+	struct dict_ent *ent;
+	unsigned int i, mask, size;
 
-#define	OPC(x)	[OPC_ ## x] = OPC_ ## x ## _impl
+	if ((dict = vm->dict_vars[vidx]) == NULL) {
+		if ((dict = calloc(1, sizeof(*dict))) == NULL) {
+			basic_out_of_memory_error(vm);
+		}
+		dict_resize(vm, dict, DICT_MINSIZE);
+		vm->dict_vars[vidx] = dict;
+	} else if ((ent = dict_lookup(dict, key, hash)) != NULL) {
+		return ent;
+	}
 
-static opc_impl_func_t opc_impls[OPC___COUNT] = {
-	OPC(TST),
-	OPC(CALL),
-	OPC(RTN),
-	OPC(DONE),
-	OPC(JMP),
-	OPC(PRS),
-	OPC(PRN),
-	OPC(SPC),
-	OPC(NLINE),
-	OPC(NXT),
-	OPC(XFER),
-	OPC(SAV),
-	OPC(RSTR),
-	OPC(CMPR),
-	OPC(LIT),
-	OPC(INNUM),
-	OPC(FIN),
-	OPC(ERR),
-	OPC(ADD),
-	OPC(SUB),
-	OPC(NEG),
-	OPC(MUL),
-	OPC(DIV),
-	OPC(STORE),
-	OPC(TSTV),
-	OPC(TSTN),
-	OPC(IND),
-	OPC(LST),
-	OPC(INIT),
-	OPC(GETLINE),
-	OPC(TSTL),
-	OPC(INSRT),
-	OPC(XINIT),
+	if (vm->limits.max_array_elems != 0 &&
+	    vm->array_elems >= vm->limits.max_array_elems) {
+		basic_limit_error(vm, TBVM_LIMIT_ARRAY_ELEMS);
+	}
 
-	/* JTTB additions. */
-	OPC(RUN),
-	OPC(EXIT),
-	OPC(CMPRX),
-	OPC(FOR),
-	OPC(STEP),
-	OPC(NXTFOR),
-	OPC(MOD),
-	OPC(POW),
-	OPC(RND),
-	OPC(ABS),
-	OPC(TSTEOL),
-	OPC(TSTS),
-	OPC(STR),
-	OPC(VAL),
-	OPC(HEX),
-	OPC(CPY),
-	OPC(LSTX),
-	OPC(STRLEN),
-	OPC(ASC),
-	OPC(CHR),
-	OPC(FIX),
-	OPC(SGN),
-	OPC(SCAN),
-	OPC(ONDONE),
-	OPC(ADVEOL),
-	OPC(INVAR),
-	OPC(POP),
-	OPC(LDPRG),
-	OPC(SVPRG),
-	OPC(DONEM),
-	OPC(SRND),
-	OPC(FLR),
-	OPC(CEIL),
-	OPC(ATN),
-	OPC(COS),
-	OPC(SIN),
-	OPC(TAN),
-	OPC(EXP),
-	OPC(LOG),
-	OPC(SQR),
-	OPC(MKS),
-	OPC(SBSTR),
-	OPC(TSTSOL),
-	OPC(NXTLN),
+	/* Keep the load factor (including tombstones) below 3/4. */
+	if ((dict->used + 1) * 4 > dict->size * 3) {
+		for (size = dict->size; (dict->count + 1) * 2 > size;
+		     size *= 2) {
+			/* nothing */
+		}
+		dict_resize(vm, dict, size);
+	}
+
+	mask = dict->size - 1;
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		ent = &dict->ents[i];
+		if (ent->key == NULL) {
+			break;
+		}
+	}
+	if (! ent->deleted) {
+		dict->used++;
+	}
+
+	/* The key must outlive any edits to the program text. */
+	if (key->lineno != 0) {
+		key = string_alloc(vm, key->str, key->len, 0);
+	}
+	ent->key = string_retain(vm, key);
+	ent->hash = hash;
+	ent->deleted = false;
+	value_init(vm, &ent->value, vtype);
+
+	dict->count++;
+	dict->iter_idx = 0;
+	vm->array_elems++;
+
+	return ent;
+}
+
+static void
+dict_delete(tbvm *vm, int vidx, string *key, unsigned int hash)
+{
+	struct dict *dict = vm->dict_vars[vidx];
+	struct dict_ent *ent;
+
+	if ((ent = dict_find(vm, vidx, key, hash)) != NULL) {
+		string_release(vm, ent->key);
+		value_release(vm, &ent->value);
+		ent->key = NULL;
+		ent->deleted = true;
+		dict->count--;
+		dict->iter_idx = 0;
+		vm->array_elems--;
+	}
+}
+
+/*
+ * Return the Nth (1-referenced) key in the dictionary.  A cursor is
+ * kept so that walking the keys in order is linear.
+ */
+static string *
+dict_nth_key(struct dict *dict, unsigned int n)
+{
+	unsigned int idx, slot;
+
+	if (dict->iter_idx != 0 && n >= dict->iter_idx) {
+		idx = dict->iter_idx;
+		slot = dict->iter_slot;
+	} else {
+		idx = 0;
+		slot = (unsigned int)-1;
+	}
+	while (idx < n) {
+		if (dict->ents[++slot].key != NULL) {
+			idx++;
+		}
+	}
+	dict->iter_idx = idx;
+	dict->iter_slot = slot;
+
+	return dict->ents[slot].key;
+}
+
+/*
+ * Look up a dictionary element.  The dictionary variable and key are
+ * on the AESTK.  There are two modes:
+ *
+ * 0 - Push the element's value.  Missing elements have the default
+ *     value for the type, but are not created.
+ *
+ * 1 - Push 1 if the element exists, otherwise 0.
+ */
+IMPL(HGET)
+{
+	int mode = get_literal(vm);
+	struct value keyval, value;
+	struct dict_ent *ent;
+	unsigned int hash;
+	string *key;
+	var_ref var;
+	int vidx, vtype;
+
+	aestk_pop_value(vm, VALUE_TYPE_ANY, &keyval);
+	var = aestk_pop_varref(vm);
+	vidx = var_raw_index(vm, var, &vtype);
+	key = dict_key(vm, &keyval, &hash);
+	ent = dict_find(vm, vidx, key, hash);
+
+	switch (mode) {
+	case 0:
+		if (ent != NULL) {
+			aestk_push_value(vm, &ent->value);
+		} else {
+			value_init(vm, &value, vtype);
+			aestk_push_value(vm, &value);
+		}
+		break;
+
+	case 1:
+		aestk_push_number(vm, ent != NULL);
+		break;
+
+	default:
+		vm_abort(vm, "!ILLEGAL HGET MODE");
+	}
+}
+
+/*
+ * Store the value on the AESTK into a dictionary element, creating
+ * it if necessary.  Underneath are the key and the dictionary variable.
+ */
+IMPL(HSET)
+{
+	struct value keyval, value;
+	struct dict_ent *ent;
+	unsigned int hash;
+	string *key;
+	var_ref var;
+	int vidx, vtype;
+
+	aestk_pop_value(vm, VALUE_TYPE_ANY, &value);
+	aestk_pop_value(vm, VALUE_TYPE_ANY, &keyval);
+	var = aestk_pop_varref(vm);
+	vidx = var_raw_index(vm, var, &vtype);
+	if (value.type != vtype) {
+		basic_wrong_type_error(vm);
+	}
+	key = dict_key(vm, &keyval, &hash);
+	ent = dict_insert(vm, vidx, vtype, key, hash);
+
+	value_release(vm, &ent->value);
+	value_retain(vm, &value);
+	ent->value = value;
+}
+
+/*
+ * Delete dictionary elements.  There are two modes:
+ *
+ * 0 - Delete the element whose key is on the AESTK (it's not an
+ *     error if there is none).
+ *
+ * 1 - Delete all of the elements.
+ *
+ * The dictionary variable is underneath.
+ */
+IMPL(HDEL)
+{
+	int mode = get_literal(vm);
+	struct value keyval;
+	unsigned int hash;
+	string *key;
+	var_ref var;
+	int vidx, vtype;
+
+	switch (mode) {
+	case 0:
+		aestk_pop_value(vm, VALUE_TYPE_ANY, &keyval);
+		var = aestk_pop_varref(vm);
+		vidx = var_raw_index(vm, var, &vtype);
+		key = dict_key(vm, &keyval, &hash);
+		dict_delete(vm, vidx, key, hash);
+		break;
+
+	case 1:
+		var = aestk_pop_varref(vm);
+		vidx = var_raw_index(vm, var, &vtype);
+		var_release_dict(vm, vidx);
+		break;
+
+	default:
+		vm_abort(vm, "!ILLEGAL HDEL MODE");
+	}
+}
+
+/*
+ * Get information about a dictionary.  There are two modes:
+ *
+ * 0 - Push the number of elements in the dictionary.
+ *
+ * 1 - Push the Nth (1-referenced) key in the dictionary.  N is on the
+ *     AESTK.  Keys are in no particular order, and the order changes
+ *     when elements are added or deleted.
+ *
+ * The dictionary variable is underneath.
+ */
+IMPL(HINFO)
+{
+	int mode = get_literal(vm);
+	struct dict *dict;
+	var_ref var;
+	int n = 0, vidx, vtype;
+
+	if (mode == 1) {
+		n = number_to_int(vm, aestk_pop_number(vm));
+	}
+	var = aestk_pop_varref(vm);
+	vidx = var_raw_index(vm, var, &vtype);
+	dict = vm->dict_vars[vidx];
+
+	switch (mode) {
+	case 0:
+		aestk_push_number(vm, dict != NULL ? dict->count : 0);
+		break;
+
+	case 1:
+		if (dict == NULL || n < 1 || (unsigned int)n > dict->count) {
+			basic_illegal_quantity_error(vm);
+		}
+		aestk_push_string(vm, dict_nth_key(dict, n));
+		break;
+
+	default:
+		vm_abort(vm, "!ILLEGAL HINFO MODE");
+	}
+}
+
+/*
+ * Advance the cursor.  There are two modes:
+ *
+ * 0 - Advance the console cursor the specified number of columns.
+ *
+ * 1 - Advance the console cursor to the specified column (0-referenced).
+ *     If the cursor is already at or beyond the specified column, it is
+ *     not moved.
+ */
+IMPL(ADVCRS)
+{
+	int mode = get_literal(vm);
+	int val = number_to_int(vm, aestk_pop_number(vm));
+
+	if (val < 0) {
+		basic_illegal_quantity_error(vm);
+	}
+
+	if (mode == 1) {
+		val = val > vm->cons_column ? val - vm->cons_column : 0;
+	}
+
+	while (val--) {
+		vm_cons_putchar(vm, ' ');
+	}
+
+	/* Just return an empty string so PRINT doesn't croak. */
+	aestk_push_string(vm, string_alloc(vm, NULL, 0, 0));
+}
+
+/*
+ * Convert a string to all-upper-case or all-lower-case based
+ * on mode:
+ *
+ * 0 - lower-case
+ *
+ * 1 - upper-case
+ */
+IMPL(UPRLWR)
+{
+	int doup = get_literal(vm);
+	string *arg = aestk_pop_string(vm);
+	string *newstr;
+	char ch;
+
+	if (arg->len == 1) {
+		string_copy_case(&ch, arg->str, 1, doup);
+		aestk_push_string(vm, string_char((unsigned char)ch));
+		return;
+	}
+
+	newstr = string_alloc(vm, NULL, arg->len, 0);
+	string_copy_case(newstr->str, arg->str, arg->len, doup);
+	aestk_push_string(vm, newstr);
+}
+
+/*
+ * Pop mode argument from AESTK.  Mode 0: pop the string to search for
+ * and the string to search.  Mode 1: as mode 0, then pop the starting
+ * position.  Push the position of the first occurrence at or after the
+ * starting position, or 0 if there is none.
+ */
+IMPL(INSTR)
+{
+	int mode = number_to_int(vm, aestk_pop_number(vm));
+	string *needle = aestk_pop_string(vm);
+	string *haystack = aestk_pop_string(vm);
+	int pos = 1;
+
+	switch (mode) {
+	case 0:
+		break;
+
+	case 1:
+		pos = number_to_int(vm, aestk_pop_number(vm));
+		if (pos < 1) {
+			basic_illegal_quantity_error(vm);
+		}
+		break;
+
+	default:
+		vm_abort(vm, "!ILLEGAL INSTR MODE");
+	}
+
+	/* Positions are 1-referenced. */
+	aestk_push_number(vm,
+	    (tbvm_number)(string_search(haystack, needle, pos - 1) + 1));
+}
+
+#undef IMPL
+
+#define	OPC(x)	[OPC_ ## x] = OPC_ ## x ## _impl
+
+static opc_impl_func_t opc_impls[OPC_Q___COUNT] = {
+	OPC(TST),
+	OPC(CALL),
+	OPC(RTN),
+	OPC(DONE),
+	OPC(JMP),
+	OPC(PRS),
+	OPC(PRN),
+	OPC(SPC),
+	OPC(NLINE),
+	OPC(NXT),
+	OPC(XFER),
+	OPC(SAV),
+	OPC(RSTR),
+	OPC(CMPR),
+	OPC(LIT),
+	OPC(INNUM),
+	OPC(FIN),
+	OPC(ERR),
+	OPC(ADD),
+	OPC(SUB),
+	OPC(NEG),
+	OPC(MUL),
+	OPC(DIV),
+	OPC(STORE),
+	OPC(TSTV),
+	OPC(TSTN),
+	OPC(IND),
+	OPC(LST),
+	OPC(INIT),
+	OPC(GETLINE),
+	OPC(TSTL),
+	OPC(INSRT),
+	OPC(XINIT),
+
+	/* JTTB additions. */
+	OPC(RUN),
+	OPC(EXIT),
+	OPC(CMPRX),
+	OPC(FOR),
+	OPC(STEP),
+	OPC(NXTFOR),
+	OPC(MOD),
+	OPC(POW),
+	OPC(RND),
+	OPC(ABS),
+	OPC(TSTEOL),
+	OPC(TSTS),
+	OPC(STR),
+	OPC(VAL),
+	OPC(HEX),
+	OPC(CPY),
+	OPC(LSTX),
+	OPC(STRLEN),
+	OPC(ASC),
+	OPC(CHR),
+	OPC(FIX),
+	OPC(SGN),
+	OPC(SCAN),
+	OPC(ONDONE),
+	OPC(ADVEOL),
+	OPC(INVAR),
+	OPC(POP),
+	OPC(LDPRG),
+	OPC(SVPRG),
+	OPC(DONEM),
+	OPC(SRND),
+	OPC(FLR),
+	OPC(CEIL),
+	OPC(ATN),
+	OPC(COS),
+	OPC(SIN),
+	OPC(TAN),
+	OPC(EXP),
+	OPC(LOG),
+	OPC(SQR),
+	OPC(MKS),
+	OPC(SBSTR),
+	OPC(TSTSOL),
+	OPC(NXTLN),
+	OPC(DMODE),
+	OPC(DSTORE),
+	OPC(DIM),
+	OPC(ARRY),
+	OPC(ADVCRS),
+	OPC(DEGRAD),
+	OPC(UPRLWR),
+	OPC(MEMO),
+	OPC(CEXPR),
+	OPC(DREAD),
+	OPC(DSEEK),
+	OPC(INSTR),
+	OPC(HGET),
+	OPC(HSET),
+	OPC(HDEL),
+	OPC(HINFO),
+
+	OPC(Q_ADDN),
+	OPC(Q_ADDS),
+	OPC(Q_SUBN),
+	OPC(Q_MULN),
+	OPC(Q_DIVN),
+	OPC(Q_CMPRN),
+	OPC(Q_CMPRS),
+	OPC(Q_CMPRXN),
+	OPC(Q_CMPRXS),
+};
+
+#undef OPC
+
+#define	OPC(x)	[OPC_ ## x] = #x
+
+static const char * const opc_names[OPC_Q___COUNT] = {
+	OPC(TST),
+	OPC(CALL),
+	OPC(RTN),
+	OPC(DONE),
+	OPC(JMP),
+	OPC(PRS),
+	OPC(PRN),
+	OPC(SPC),
+	OPC(NLINE),
+	OPC(NXT),
+	OPC(XFER),
+	OPC(SAV),
+	OPC(RSTR),
+	OPC(CMPR),
+	OPC(LIT),
+	OPC(INNUM),
+	OPC(FIN),
+	OPC(ERR),
+	OPC(ADD),
+	OPC(SUB),
+	OPC(NEG),
+	OPC(MUL),
+	OPC(DIV),
+	OPC(STORE),
+	OPC(TSTV),
+	OPC(TSTN),
+	OPC(IND),
+	OPC(LST),
+	OPC(INIT),
+	OPC(GETLINE),
+	OPC(TSTL),
+	OPC(INSRT),
+	OPC(XINIT),
+
+	/* JTTB additions. */
+	OPC(RUN),
+	OPC(EXIT),
+	OPC(CMPRX),
+	OPC(FOR),
+	OPC(STEP),
+	OPC(NXTFOR),
+	OPC(MOD),
+	OPC(POW),
+	OPC(RND),
+	OPC(ABS),
+	OPC(TSTEOL),
+	OPC(TSTS),
+	OPC(STR),
+	OPC(VAL),
+	OPC(HEX),
+	OPC(CPY),
+	OPC(LSTX),
+	OPC(STRLEN),
+	OPC(ASC),
+	OPC(CHR),
+	OPC(FIX),
+	OPC(SGN),
+	OPC(SCAN),
+	OPC(ONDONE),
+	OPC(ADVEOL),
+	OPC(INVAR),
+	OPC(POP),
+	OPC(LDPRG),
+	OPC(SVPRG),
+	OPC(DONEM),
+	OPC(SRND),
+	OPC(FLR),
+	OPC(CEIL),
+	OPC(ATN),
+	OPC(COS),
+	OPC(SIN),
+	OPC(TAN),
+	OPC(EXP),
+	OPC(LOG),
+	OPC(SQR),
+	OPC(MKS),
+	OPC(SBSTR),
+	OPC(TSTSOL),
+	OPC(NXTLN),
 	OPC(DMODE),
 	OPC(DSTORE),
 	OPC(DIM),
@@ -4090,9 +5855,863 @@ static opc_impl_func_t opc_impls[OPC___COUNT] = {
 	OPC(ADVCRS),
 	OPC(DEGRAD),
 	OPC(UPRLWR),
+	OPC(MEMO),
+	OPC(CEXPR),
+	OPC(DREAD),
+	OPC(DSEEK),
+	OPC(INSTR),
+	OPC(HGET),
+	OPC(HSET),
+	OPC(HDEL),
+	OPC(HINFO),
+
+	OPC(Q_ADDN),
+	OPC(Q_ADDS),
+	OPC(Q_SUBN),
+	OPC(Q_MULN),
+	OPC(Q_DIVN),
+	OPC(Q_CMPRN),
+	OPC(Q_CMPRS),
+	OPC(Q_CMPRXN),
+	OPC(Q_CMPRXS),
 };
 
-#undef OPC
+#undef OPC
+
+static const char *
+opc_name(unsigned int opc)
+{
+	if (opc > OPC_Q___LAST || opc_names[opc] == NULL) {
+		return "???";
+	}
+	return opc_names[opc];
+}
+
+#define	OPC(x, f)	[OPC_ ## x] = (f)
+
+/* Operands and control flow of each opcode; must agree with tbasm. */
+static const unsigned char opc_flags[OPC___COUNT] = {
+	OPC(TST,	OPC_F_LABEL | OPC_F_STRING),
+	OPC(CALL,	OPC_F_LABEL),
+	OPC(RTN,	OPC_F_TERM),
+	OPC(JMP,	OPC_F_LABEL | OPC_F_TERM),
+	OPC(NXT,	OPC_F_TERM),
+	OPC(XFER,	OPC_F_TERM),
+	OPC(LIT,	OPC_F_NUMBER),
+	OPC(FIN,	OPC_F_TERM),
+	OPC(ERR,	OPC_F_TERM),
+	OPC(TSTV,	OPC_F_LABEL),
+	OPC(TSTN,	OPC_F_LABEL),
+	OPC(TSTL,	OPC_F_LABEL),
+	OPC(RUN,	OPC_F_TERM),
+	OPC(CMPRX,	OPC_F_LABEL),
+	OPC(NXTFOR,	OPC_F_TERM),
+	OPC(TSTEOL,	OPC_F_LABEL),
+	OPC(TSTS,	OPC_F_LABEL),
+	OPC(SCAN,	OPC_F_LABEL | OPC_F_STRING),
+	OPC(ONDONE,	OPC_F_LABEL),
+	OPC(LDPRG,	OPC_F_TERM),
+	OPC(SVPRG,	OPC_F_TERM),
+	OPC(DONEM,	OPC_F_NUMBER),
+	OPC(TSTSOL,	OPC_F_LABEL),
+	OPC(NXTLN,	OPC_F_LABEL),
+	OPC(DMODE,	OPC_F_NUMBER),
+	OPC(ADVCRS,	OPC_F_NUMBER),
+	OPC(DEGRAD,	OPC_F_NUMBER),
+	OPC(UPRLWR,	OPC_F_NUMBER),
+	OPC(HGET,	OPC_F_NUMBER),
+	OPC(HDEL,	OPC_F_NUMBER),
+	OPC(HINFO,	OPC_F_NUMBER),
+};
+
+#undef OPC
+
+/*********** Compiled expression routines **********/
+
+static void
+expr_run(tbvm *vm, const struct expr_cache *ent)
+{
+	const struct expr_op *op;
+	struct value value;
+	unsigned int i;
+
+	for (i = 0, op = ent->ops; i < ent->nops; i++, op++) {
+		switch (op->kind) {
+		case EXPR_OP_EXEC:
+			vm->opc_pc = op->addr;
+			vm->pc = op->addr + 1;
+			vm->opc = (unsigned char)vm->vm_prog[op->addr];
+			(*opc_impls[vm->opc])(vm);
+			break;
+
+		case EXPR_OP_PUSH:
+			value = op->value;
+			aestk_push_value(vm, &value);
+			break;
+
+		case EXPR_OP_VAR:
+			var_get_value(vm, op->value.var_ref, &value);
+			aestk_push_value(vm, &value);
+			break;
+
+		case EXPR_OP_STR:
+			aestk_push_string(vm, string_intern(vm,
+			    &vm->lbuf[op->addr], op->len));
+			break;
+		}
+	}
+	vm->vm_insns += ent->nops;
+}
+
+/*
+ * Instructions that only operate on the AESTK (and variables, arrays,
+ * and the console), and so can be run from a compiled expression.
+ */
+static bool
+expr_exec_p(unsigned char opc)
+{
+	switch (opc) {
+	case OPC_LIT:
+	case OPC_ADD:
+	case OPC_SUB:
+	case OPC_NEG:
+	case OPC_MUL:
+	case OPC_DIV:
+	case OPC_MOD:
+	case OPC_POW:
+	case OPC_IND:
+	case OPC_ARRY:
+	case OPC_RND:
+	case OPC_ABS:
+	case OPC_STR:
+	case OPC_VAL:
+	case OPC_HEX:
+	case OPC_STRLEN:
+	case OPC_ASC:
+	case OPC_CHR:
+	case OPC_FIX:
+	case OPC_SGN:
+	case OPC_FLR:
+	case OPC_CEIL:
+	case OPC_ATN:
+	case OPC_COS:
+	case OPC_SIN:
+	case OPC_TAN:
+	case OPC_EXP:
+	case OPC_LOG:
+	case OPC_SQR:
+	case OPC_MKS:
+	case OPC_SBSTR:
+	case OPC_ADVCRS:
+	case OPC_DEGRAD:
+	case OPC_UPRLWR:
+	case OPC_INSTR:
+	case OPC_HGET:
+	case OPC_HINFO:
+	case OPC_Q_ADDN:
+	case OPC_Q_ADDS:
+	case OPC_Q_SUBN:
+	case OPC_Q_MULN:
+	case OPC_Q_DIVN:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*
+ * Instructions whose result depends only on their numeric operands, and
+ * how many they take.  These are folded into a constant when all of
+ * their operands are constants.
+ */
+static int
+expr_fold_nargs(unsigned char opc)
+{
+	switch (opc) {
+	case OPC_ADD:
+	case OPC_SUB:
+	case OPC_MUL:
+	case OPC_DIV:
+	case OPC_MOD:
+	case OPC_POW:
+	case OPC_Q_ADDN:
+	case OPC_Q_SUBN:
+	case OPC_Q_MULN:
+	case OPC_Q_DIVN:
+		return 2;
+
+	case OPC_NEG:
+	case OPC_ABS:
+	case OPC_FIX:
+	case OPC_SGN:
+	case OPC_FLR:
+	case OPC_CEIL:
+	case OPC_ATN:
+	case OPC_COS:
+	case OPC_SIN:
+	case OPC_TAN:
+	case OPC_EXP:
+	case OPC_LOG:
+	case OPC_SQR:
+	case OPC_DEGRAD:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static bool
+expr_fold_p(tbvm *vm, int nargs)
+{
+	const struct expr_op *op;
+	int i;
+
+	if (nargs == 0 || vm->expr_rec_nops < nargs ||
+	    aestk_peek(vm, 0)->type != VALUE_TYPE_NUMBER) {
+		return false;
+	}
+	op = &vm->expr_rec_ops[vm->expr_rec_nops - nargs];
+	for (i = 0; i < nargs; i++, op++) {
+		if (op->kind != EXPR_OP_PUSH ||
+		    op->value.type != VALUE_TYPE_NUMBER) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+expr_record_finish(tbvm *vm)
+{
+	struct expr_cache *ent = vm->expr_rec;
+	size_t size = vm->expr_rec_nops * sizeof(*ent->ops);
+
+	vm->expr_rec = NULL;
+	if (vm->expr_rec_nops == 0 || (ent->ops = malloc(size)) == NULL) {
+		return;
+	}
+	memcpy(ent->ops, vm->expr_rec_ops, size);
+	ent->nops = vm->expr_rec_nops;
+	ent->end_lbuf_ptr = vm->lbuf_ptr;
+}
+
+/*
+ * Called after each instruction while an expression is being recorded.
+ * Anything that isn't understood leaves the expression uncompiled.
+ */
+static void
+expr_record(tbvm *vm)
+{
+	struct expr_op *op, *prev;
+	bool taken;
+	int nargs;
+
+	if (vm->cstk_ptr < vm->expr_rec_depth) {
+		/* That was the RTN from EXPR. */
+		expr_record_finish(vm);
+		return;
+	}
+
+	switch (vm->opc) {
+	case OPC_TST:
+	case OPC_CALL:
+	case OPC_RTN:
+	case OPC_JMP:
+	case OPC_MEMO:
+	case OPC_CEXPR:
+		return;
+
+	default:
+		break;
+	}
+
+	if (vm->expr_rec_nops == SIZE_EXPR_OPS) {
+		vm->expr_rec = NULL;
+		return;
+	}
+	op = &vm->expr_rec_ops[vm->expr_rec_nops];
+	prev = vm->expr_rec_nops ? op - 1 : NULL;
+
+	/* Did a TSTx fall through (i.e. find what it was looking for)? */
+	taken = vm->pc != vm->opc_pc + 1 + vm->vm_lblsize;
+
+	switch (vm->opc) {
+	case OPC_TSTV:
+	case OPC_TSTN:
+		if (taken) {
+			return;
+		}
+		op->kind = EXPR_OP_PUSH;
+		op->value = *aestk_peek(vm, 0);
+		break;
+
+	case OPC_TSTS:
+		if (taken) {
+			return;
+		}
+		op->kind = EXPR_OP_STR;
+		op->len = aestk_peek(vm, 0)->string->len;
+		op->addr = vm->lbuf_ptr - 1 - op->len;
+		break;
+
+	case OPC_LIT:
+		op->kind = EXPR_OP_PUSH;
+		op->value = *aestk_peek(vm, 0);
+		break;
+
+	case OPC_IND:
+		if (prev != NULL && prev->kind == EXPR_OP_PUSH &&
+		    prev->value.type == VALUE_TYPE_VARREF) {
+			prev->kind = EXPR_OP_VAR;
+			return;
+		}
+		/* FALLTHROUGH */
+
+	default:
+		if (! expr_exec_p(vm->opc)) {
+			vm->expr_rec = NULL;
+			return;
+		}
+
+		/*
+		 * Constant folding: the result that was just computed
+		 * replaces the instruction and its constant operands, so
+		 * it is exactly what evaluating them would produce.
+		 */
+		nargs = expr_fold_nargs(vm->opc);
+		if (expr_fold_p(vm, nargs)) {
+			vm->expr_rec_nops -= nargs;
+			op = &vm->expr_rec_ops[vm->expr_rec_nops];
+			op->kind = EXPR_OP_PUSH;
+			op->value = *aestk_peek(vm, 0);
+			break;
+		}
+
+		op->kind = EXPR_OP_EXEC;
+		op->addr = vm->opc_pc;
+		break;
+	}
+	vm->expr_rec_nops++;
+}
+
+/*********** VM program verifier **********/
+
+static bool
+verify_error(tbvm *vm, const char *msg, size_t addr)
+{
+	snprintf(vm->vm_prog_error, sizeof(vm->vm_prog_error),
+	    "%s at %zu", msg, addr);
+	return false;
+}
+
+/*
+ * Check a VM program before it's allowed to run:
+ *
+ *	- every instruction is a defined opcode with all of its operands
+ *	  present, and every string operand is terminated
+ *
+ *	- every label, including the collector and executor entry
+ *	  points, is the address of an instruction
+ *
+ *	- the last instruction does not fall off the end of the program
+ *
+ * This is what allows the interpreter to fetch without bounds checks.
+ */
+static bool
+verify_prog(tbvm *vm, const char *prog, size_t progsize,
+    unsigned int lblsize, unsigned int collector_pc, unsigned int executor_pc)
+{
+	unsigned char opc = 0, *insn;
+	size_t pc, label;
+	bool rv = false;
+
+	/* insn[pc] is set if an instruction starts at pc. */
+	if ((insn = calloc(progsize, 1)) == NULL) {
+		return verify_error(vm, "out of memory", 0);
+	}
+
+	for (pc = 0; pc < progsize;) {
+		insn[pc] = 1;
+		opc = (unsigned char)prog[pc];
+		if (opc > OPC___LAST || opc_impls[opc] == NULL) {
+			verify_error(vm, "undefined opcode", pc);
+			goto out;
+		}
+		pc++;
+		if (opc_flags[opc] & OPC_F_NUMBER) {
+			pc += OPC_NUM_SIZE;
+		}
+		if (opc_flags[opc] & OPC_F_LABEL) {
+			pc += lblsize;
+		}
+		if (pc > progsize) {
+			verify_error(vm, "truncated instruction", progsize);
+			goto out;
+		}
+		if (opc_flags[opc] & OPC_F_STRING) {
+			do {
+				if (pc == progsize) {
+					verify_error(vm, "unterminated string",
+					    pc);
+					goto out;
+				}
+			} while ((prog[pc++] & 0x80) == 0);
+		}
+	}
+	if ((opc_flags[opc] & OPC_F_TERM) == 0) {
+		verify_error(vm, "program falls off the end", progsize);
+		goto out;
+	}
+
+	for (pc = 0; pc < progsize; pc++) {
+		if (insn[pc] == 0 ||
+		    (opc_flags[(unsigned char)prog[pc]] & OPC_F_LABEL) == 0) {
+			continue;
+		}
+		label = decode_label(&prog[pc + 1], lblsize);
+		if (label >= progsize || insn[label] == 0) {
+			verify_error(vm, "invalid label", pc);
+			goto out;
+		}
+	}
+	if (insn[collector_pc] == 0) {
+		verify_error(vm, "invalid collector entry point", collector_pc);
+		goto out;
+	}
+	if (insn[executor_pc] == 0) {
+		verify_error(vm, "invalid executor entry point", executor_pc);
+		goto out;
+	}
+	rv = true;
+
+ out:
+	free(insn);
+	return rv;
+}
+
+/*********** Sampling profiler routines **********/
+
+static unsigned int
+prof_hash(const struct prof_sample *key)
+{
+	const unsigned char *cp = (const unsigned char *)&key->lineno;
+	const unsigned char *ep = (const unsigned char *)(key + 1);
+	unsigned int hash = 2166136261U;	/* FNV-1a */
+
+	for (; cp < ep; cp++) {
+		hash = (hash ^ *cp) * 16777619U;
+	}
+	return hash;
+}
+
+static bool
+prof_key_equal(const struct prof_sample *s1, const struct prof_sample *s2)
+{
+	return memcmp(&s1->lineno, &s2->lineno,
+	    sizeof(*s1) - offsetof(struct prof_sample, lineno)) == 0;
+}
+
+/*
+ * Allocate the profiler histogram.  The histogram is allocated up
+ * front so that tbvm_profile_sample() never has to allocate memory.
+ */
+bool
+tbvm_profile_start(tbvm *vm)
+{
+	if (vm->prof == NULL) {
+		vm->prof = calloc(PROF_NSAMPLES, sizeof(*vm->prof));
+	}
+	return vm->prof != NULL;
+}
+
+/*
+ * Record a sample of the VM's current state.  This is intended to be
+ * called from a periodic timer signal handler in the driver program.
+ * It does not allocate memory or take any locks, and the signal handler
+ * is the only writer of the histogram, so it is safe to call it at any
+ * point while the VM is running.
+ */
+void
+tbvm_profile_sample(tbvm *vm)
+{
+	struct prof_sample key, *sample;
+	unsigned int hash, i;
+	int slot;
+
+	if (vm->prof == NULL) {
+		return;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.lineno = vm->direct ? 0 : vm->lineno;
+	key.pc = vm->opc_pc;
+	key.opc = vm->opc;
+	for (slot = 0; slot < vm->sbrstk_ptr && slot < SIZE_SBRSTK; slot++) {
+		if (vm->sbrstk[slot].var == SUBR_VAR_SUBROUTINE &&
+		    key.depth < PROF_MAXDEPTH) {
+			key.chain[key.depth++] = vm->sbrstk[slot].lineno;
+		}
+	}
+
+	hash = prof_hash(&key);
+	for (i = 0; i < PROF_NSAMPLES; i++) {
+		sample = &vm->prof[(hash + i) & (PROF_NSAMPLES - 1)];
+		if (sample->count == 0) {
+			*sample = key;
+			sample->count = 1;
+			return;
+		}
+		if (prof_key_equal(sample, &key)) {
+			sample->count++;
+			return;
+		}
+	}
+	vm->prof_dropped++;
+}
+
+/*
+ * Write the profile histogram in the "folded stacks" format consumed
+ * by flame graph tools: one line per unique stack, with frames separated
+ * by semicolons and followed by the sample count.  The stack is made up
+ * of the lines that issued each active GOSUB, the current line, and the
+ * VM instruction being executed.
+ */
+void
+tbvm_profile_dump(tbvm *vm, FILE *fp)
+{
+	const struct prof_sample *sample;
+	int i, depth;
+
+	if (vm->prof == NULL) {
+		return;
+	}
+
+	for (i = 0; i < PROF_NSAMPLES; i++) {
+		sample = &vm->prof[i];
+		if (sample->count == 0) {
+			continue;
+		}
+		for (depth = 0; depth < sample->depth; depth++) {
+			fprintf(fp, "LINE %d;", sample->chain[depth]);
+		}
+		if (sample->lineno == 0) {
+			fprintf(fp, "DIRECT;");
+		} else {
+			fprintf(fp, "LINE %d;", sample->lineno);
+		}
+		fprintf(fp, "IL %u %s %lu\n", sample->pc,
+		    opc_name(sample->opc), sample->count);
+	}
+	if (vm->prof_dropped) {
+		fprintf(fp, "DROPPED %lu\n", vm->prof_dropped);
+	}
+}
+
+/*********** Resource limit routines **********/
+
+/*
+ * Limits are checked when vm_insns reaches limit_check_insns, so that
+ * the cost while running is a single compare per VM instruction.  The
+ * wall clock is only consulted every LIMIT_TIME_INTERVAL instructions.
+ */
+#define	LIMIT_TIME_INTERVAL	65536
+
+static void
+limits_schedule(tbvm *vm)
+{
+	unsigned long next = ULONG_MAX;
+
+	if (vm->limits.max_insns != 0) {
+		next = vm->limit_base_insns + vm->limits.max_insns;
+	}
+	if (vm->limits.max_seconds != 0 &&
+	    vm->vm_insns + LIMIT_TIME_INTERVAL < next) {
+		next = vm->vm_insns + LIMIT_TIME_INTERVAL;
+	}
+	vm->limit_check_insns = next;
+}
+
+/*
+ * Start a new command's instruction and time budgets.
+ */
+static void
+limits_reset(tbvm *vm)
+{
+	vm->limit_base_insns = vm->vm_insns;
+	if (vm->limits.max_seconds != 0 &&
+	    ! vm_io_gettime(vm, &vm->limit_base_time)) {
+		vm->limit_base_time = 0;
+	}
+	limits_schedule(vm);
+}
+
+static void
+limits_check(tbvm *vm)
+{
+	unsigned long now;
+
+	if (vm->limits.max_insns != 0 &&
+	    vm->vm_insns - vm->limit_base_insns >= vm->limits.max_insns) {
+		basic_limit_error(vm, TBVM_LIMIT_INSNS);
+	}
+	if (vm->limits.max_seconds != 0 && vm->limit_base_time != 0 &&
+	    vm_io_gettime(vm, &now) &&
+	    now - vm->limit_base_time >= vm->limits.max_seconds) {
+		basic_limit_error(vm, TBVM_LIMIT_SECONDS);
+	}
+	limits_schedule(vm);
+}
+
+void
+tbvm_set_limits(tbvm *vm, const struct tbvm_limits *limits)
+{
+	if (limits != NULL) {
+		vm->limits = *limits;
+	} else {
+		memset(&vm->limits, 0, sizeof(vm->limits));
+	}
+	vm->limit_status = TBVM_LIMIT_NONE;
+	limits_reset(vm);
+}
+
+int
+tbvm_limit_status(tbvm *vm)
+{
+	return vm->limit_status;
+}
+
+/*********** IL coverage routines **********/
+
+/*
+ * Start counting how many times the instruction at each VM program
+ * address is executed.
+ */
+bool
+tbvm_coverage_start(tbvm *vm)
+{
+	free(vm->cov);
+	vm->cov = calloc(vm->vm_progsize, sizeof(*vm->cov));
+	return vm->cov != NULL;
+}
+
+/*
+ * Return the execution counts, indexed by VM program address.
+ */
+const unsigned long *
+tbvm_coverage(tbvm *vm, size_t *sizep)
+{
+	*sizep = vm->cov != NULL ? vm->vm_progsize : 0;
+	return vm->cov;
+}
+
+/*********** Hardware performance counter routines **********/
+
+static void
+perf_stat_add(struct perf_stat *stat, const unsigned long long *before,
+    const unsigned long long *after, const unsigned long long *bias)
+{
+	unsigned long long delta;
+	int i;
+
+	stat->count++;
+	for (i = 0; i < TBVM_PERF_NCOUNTERS; i++) {
+		delta = after[i] - before[i];
+		stat->val[i] += delta > bias[i] ? delta - bias[i] : 0;
+	}
+}
+
+/*
+ * Execute the current opcode with the hardware performance counters
+ * read immediately before and after, and charge the difference to the
+ * opcode and the BASIC line it was executed on.  If the opcode raises
+ * a BASIC error, the measurement is simply lost.
+ */
+static void
+perf_exec_opcode(tbvm *vm)
+{
+	unsigned long long before[TBVM_PERF_NCOUNTERS];
+	unsigned long long after[TBVM_PERF_NCOUNTERS];
+	unsigned char opc = vm->opc;
+	int lineno = vm->direct ? 0 : vm->lineno;
+
+	vm->perf_countdown = vm->perf_period;
+
+	if (! vm_io_perf_read(vm, before)) {
+		(*opc_impls[opc])(vm);
+		return;
+	}
+	(*opc_impls[opc])(vm);
+	if (! vm_io_perf_read(vm, after)) {
+		return;
+	}
+
+	perf_stat_add(&vm->perf_opcs[opc], before, after, vm->perf_bias);
+	perf_stat_add(&vm->perf_lines[lineno], before, after, vm->perf_bias);
+}
+
+/*
+ * Measure the cost of reading the counters themselves, so that it
+ * can be subtracted from each measurement.
+ */
+static bool
+perf_calibrate(tbvm *vm)
+{
+	unsigned long long before[TBVM_PERF_NCOUNTERS];
+	unsigned long long after[TBVM_PERF_NCOUNTERS];
+	int i, pass;
+
+	for (i = 0; i < TBVM_PERF_NCOUNTERS; i++) {
+		vm->perf_bias[i] = ~0ULL;
+	}
+	for (pass = 0; pass < 16; pass++) {
+		if (! vm_io_perf_read(vm, before) ||
+		    ! vm_io_perf_read(vm, after)) {
+			return false;
+		}
+		for (i = 0; i < TBVM_PERF_NCOUNTERS; i++) {
+			if (after[i] - before[i] < vm->perf_bias[i]) {
+				vm->perf_bias[i] = after[i] - before[i];
+			}
+		}
+	}
+	return true;
+}
+
+static const char * const perf_header =
+    "     count  cycles/ex   insns/ex  br-miss/ex  $-miss/ex  %cycles\n";
+
+static void
+perf_dump_stat(const struct perf_stat *stat, unsigned long long total,
+    FILE *fp)
+{
+	double count = (double)stat->count;
+
+	fprintf(fp, "%10lu %10.1f %10.1f %11.3f %10.3f %7.2f%%\n",
+	    stat->count,
+	    stat->val[TBVM_PERF_CYCLES] / count,
+	    stat->val[TBVM_PERF_INSNS] / count,
+	    stat->val[TBVM_PERF_BRANCH_MISSES] / count,
+	    stat->val[TBVM_PERF_CACHE_MISSES] / count,
+	    total ? (100.0 * stat->val[TBVM_PERF_CYCLES]) / total : 0.0);
+}
+
+static const struct perf_stat *perf_sort_base;
+
+static int
+perf_sort_cmp(const void *v1, const void *v2)
+{
+	const struct perf_stat *s1 = &perf_sort_base[*(const int *)v1];
+	const struct perf_stat *s2 = &perf_sort_base[*(const int *)v2];
+
+	if (s1->val[TBVM_PERF_CYCLES] > s2->val[TBVM_PERF_CYCLES]) {
+		return -1;
+	}
+	if (s1->val[TBVM_PERF_CYCLES] < s2->val[TBVM_PERF_CYCLES]) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Sort the non-empty entries of a perf_stat table by total cycles,
+ * most expensive first.  Returns the number of entries in the index.
+ */
+static int
+perf_sort(const struct perf_stat *stats, int nstats, int *idx,
+    unsigned long long *totalp)
+{
+	int i, n;
+
+	*totalp = 0;
+	for (i = n = 0; i < nstats; i++) {
+		if (stats[i].count != 0) {
+			idx[n++] = i;
+			*totalp += stats[i].val[TBVM_PERF_CYCLES];
+		}
+	}
+	perf_sort_base = stats;
+	qsort(idx, n, sizeof(*idx), perf_sort_cmp);
+	return n;
+}
+
+/*
+ * Enable hardware performance counter measurements.  One out of every
+ * "period" VM instructions is bracketed by counter reads supplied by
+ * the driver.  Returns false if the counters cannot be read.
+ */
+bool
+tbvm_set_perf_io(tbvm *vm, const struct tbvm_perf_io *io, unsigned int period)
+{
+	vm->perf_io = NULL;
+	if (io == NULL) {
+		return true;
+	}
+
+	if (vm->perf_opcs == NULL || vm->perf_lines == NULL) {
+		free(vm->perf_opcs);
+		free(vm->perf_lines);
+		vm->perf_opcs = calloc(OPC_Q___COUNT, sizeof(*vm->perf_opcs));
+		vm->perf_lines = calloc(MAX_LINENO + 1,
+		    sizeof(*vm->perf_lines));
+		if (vm->perf_opcs == NULL || vm->perf_lines == NULL) {
+			free(vm->perf_opcs);
+			free(vm->perf_lines);
+			vm->perf_opcs = NULL;
+			vm->perf_lines = NULL;
+			return false;
+		}
+	}
+
+	vm->perf_io = io;
+	if (! perf_calibrate(vm)) {
+		vm->perf_io = NULL;
+		return false;
+	}
+	vm->perf_period = vm->perf_countdown = period ? period : 1;
+	return true;
+}
+
+void
+tbvm_perf_dump(tbvm *vm, FILE *fp)
+{
+	unsigned long long total;
+	int *idx, i, n;
+
+	if (vm->perf_opcs == NULL) {
+		return;
+	}
+	idx = calloc(MAX_LINENO + 1, sizeof(*idx));
+	if (idx == NULL) {
+		return;
+	}
+
+	fprintf(fp, "# 1 in %u VM instructions measured; "
+	    "read overhead of %llu cycles, %llu insns subtracted\n",
+	    vm->perf_period, vm->perf_bias[TBVM_PERF_CYCLES],
+	    vm->perf_bias[TBVM_PERF_INSNS]);
+
+	fprintf(fp, "\n# By VM opcode\n%-8s%s", "opcode", perf_header);
+	n = perf_sort(vm->perf_opcs, OPC_Q___COUNT, idx, &total);
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%-8s", opc_name(idx[i]));
+		perf_dump_stat(&vm->perf_opcs[idx[i]], total, fp);
+	}
+
+	fprintf(fp, "\n# By BASIC line\n%-8s%s", "line", perf_header);
+	n = perf_sort(vm->perf_lines, MAX_LINENO + 1, idx, &total);
+	for (i = 0; i < n; i++) {
+		if (idx[i] == 0) {
+			fprintf(fp, "%-8s", "DIRECT");
+		} else {
+			fprintf(fp, "%-8d", idx[i]);
+		}
+		perf_dump_stat(&vm->perf_lines[idx[i]], total, fp);
+	}
+
+	free(idx);
+}
 
 /*********** Interface routines **********/
 
@@ -4118,8 +6737,11 @@ tbvm
 
 	vm->context = context;
 	vm->file_io = &default_file_io;
+	vm->limit_check_insns = ULONG_MAX;
 
-	tbvm_set_prog(vm, tbvm_program, sizeof(tbvm_program));
+	if (! tbvm_set_prog(vm, tbvm_program, sizeof(tbvm_program))) {
+		abort();
+	}
 
 	init_vm(vm);
 
@@ -4145,10 +6767,38 @@ tbvm_set_exc_io(tbvm *vm, const struct tbvm_exc_io *io)
 }
 
 void
+tbvm_set_trace_io(tbvm *vm, const struct tbvm_trace_io *io)
+{
+	vm->trace_io = io;
+}
+
+bool
 tbvm_set_prog(tbvm *vm, const char *prog, size_t progsize)
 {
-	vm->vm_prog = prog;
-	vm->vm_progsize = progsize;
+	unsigned int lblsize, collector_pc, executor_pc;
+	char *text;
+
+	/* Validate the header. */
+	if (progsize < OPC_HDR_SIZE ||
+	    prog[0] != OPC_HDR_MAGIC0 || prog[1] != OPC_HDR_MAGIC1 ||
+	    prog[2] != OPC_HDR_MAGIC2 || prog[3] != OPC_HDR_MAGIC3) {
+		return verify_error(vm, "bad magic number", 0);
+	}
+	if (prog[OPC_HDR_OFF_VERSION] != OPC_HDR_VERSION) {
+		return verify_error(vm, "unsupported version",
+		    OPC_HDR_OFF_VERSION);
+	}
+	lblsize = (unsigned char)prog[OPC_HDR_OFF_LBL_SIZE];
+	if (lblsize != OPC_LBL_SIZE && lblsize != OPC_LBL_SIZE_WIDE) {
+		return verify_error(vm, "unsupported label size",
+		    OPC_HDR_OFF_LBL_SIZE);
+	}
+	prog += OPC_HDR_SIZE;
+	progsize -= OPC_HDR_SIZE;
+	if (progsize <= lblsize * 2 || progsize - lblsize * 2 > INT_MAX) {
+		return verify_error(vm, "bad program size", progsize);
+	}
+	progsize -= lblsize * 2;
 
 	/*
 	 * Get the two special labels appended to the end of the
@@ -4157,14 +6807,89 @@ tbvm_set_prog(tbvm *vm, const char *prog, size_t progsize)
 	 *	- Line collector routine
 	 *	- Statement executor routine
 	 */
-	vm->pc = progsize - (OPC_LBL_SIZE * 2);
-	vm->collector_pc = get_label(vm);
-	vm->executor_pc = get_label(vm);
+	collector_pc = decode_label(&prog[progsize], lblsize);
+	executor_pc = decode_label(&prog[progsize + lblsize], lblsize);
+	if (collector_pc >= progsize || executor_pc >= progsize) {
+		return verify_error(vm, "missing entry points", progsize);
+	}
 
+	if (! verify_prog(vm, prog, progsize, lblsize, collector_pc,
+			  executor_pc)) {
+		return false;
+	}
+
+	/* The VM gets its own copy, which quicken() may rewrite. */
+	if ((text = malloc(progsize)) == NULL) {
+		return verify_error(vm, "out of memory", 0);
+	}
+	memcpy(text, prog, progsize);
+	free(vm->vm_prog);
+
+	/* Anything cached about the old program is now stale. */
+	tst_cache_flush(vm);
+	expr_cache_flush(vm);
+	data_index_flush(vm);
+	string_intern_flush(vm);
+
+	vm->vm_prog = text;
+	vm->vm_progsize = progsize;
+	vm->vm_prog_builtin = (prog == &tbvm_program[OPC_HDR_SIZE]);
+	vm->vm_lblsize = lblsize;
+	vm->collector_pc = collector_pc;
+	vm->executor_pc = executor_pc;
 	vm->pc = vm->opc_pc = 0;
-	vm->vm_progsize -= (OPC_LBL_SIZE * 2);
+
+	/* Coverage counts are only meaningful for a single program. */
+	if (vm->cov != NULL) {
+		(void) tbvm_coverage_start(vm);
+	}
+	return true;
+}
+
+const char *
+tbvm_prog_error(tbvm *vm)
+{
+	return vm->vm_prog_error;
+}
+
+#ifdef TBVM_CONFIG_COMPILED_PROGRAM
+/*
+ * The built-in VM program, compiled to C by "tbasm -C".  AOT_INSN()
+ * does the same per-instruction work as the loop in tbvm_runprog(),
+ * less fetching and decoding the opcode.
+ */
+static bool
+aot_insn(tbvm *vm, unsigned int addr, unsigned char opc)
+{
+	string_gc(vm);
+	if (check_break(vm)) {
+		return false;
+	}
+	if (vm->vm_insns >= vm->limit_check_insns) {
+		limits_check(vm);
+	}
+	if (vm->expr_rec != NULL) {
+		expr_record(vm);	/* the previous insn */
+	}
+	vm->opc_pc = addr;
+	vm->pc = addr + 1;
+	vm->opc = opc;
+	vm->vm_insns++;
+	return true;
 }
 
+#define	AOT_INSN(addr, opcode)						\
+do {									\
+	if (! aot_insn(vm, (addr), (opcode))) {				\
+		goto dispatch;						\
+	}								\
+} while (/*CONSTCOND*/0)
+
+#include "tbvm_program_compiled.c"
+
+#undef AOT_INSN
+#endif /* TBVM_CONFIG_COMPILED_PROGRAM */
+
 static void
 tbvm_runprog(tbvm *vm)
 {
@@ -4176,14 +6901,36 @@ tbvm_runprog(tbvm *vm)
 	(void) vm_io_math_exc(vm);	/* clear any pending exceptions */
 #endif /* TBVM_CONFIG_INTEGER_ONLY */
 
+#ifdef TBVM_CONFIG_COMPILED_PROGRAM
+	/*
+	 * The compiled program is only good for the built-in VM program,
+	 * and doesn't do the coverage or performance counter hooks.
+	 */
+	if (vm->vm_prog_builtin && vm->cov == NULL &&
+	    vm->perf_io == NULL) {
+		tbvm_compiled_program(vm);
+		return;
+	}
+#endif /* TBVM_CONFIG_COMPILED_PROGRAM */
+
 	while (vm->vm_run) {
 		string_gc(vm);
 		check_break(vm);
+		if (vm->vm_insns >= vm->limit_check_insns) {
+			limits_check(vm);
+		}
 		vm->opc = (unsigned char)get_opcode(vm);
-		if (vm->opc > OPC___LAST || opc_impls[vm->opc] == NULL) {
-			vm_abort(vm, "!UNDEFINED VM OPCODE");
+		if (vm->cov != NULL) {
+			vm->cov[vm->opc_pc]++;
+		}
+		if (vm->perf_io != NULL && --vm->perf_countdown == 0) {
+			perf_exec_opcode(vm);
+		} else {
+			(*opc_impls[vm->opc])(vm);
+		}
+		if (vm->expr_rec != NULL) {
+			expr_record(vm);
 		}
-		(*opc_impls[vm->opc])(vm);
 		vm->vm_insns++;
 	}
 }
@@ -4211,6 +6958,18 @@ tbvm_exec(tbvm *vm)
 void
 tbvm_free(tbvm *vm)
 {
+	int i;
+
+	for (i = 0; i < NUM_VARS; i++) {
+		var_release_dict(vm, i);
+	}
 	string_freeall(vm);
+	free(vm->prof);
+	free(vm->perf_opcs);
+	free(vm->perf_lines);
+	free(vm->cov);
+	free(vm->vm_prog);
+	expr_cache_flush(vm);
+	data_index_flush(vm);
 	free(vm);
 }
@@ -32,6 +32,7 @@
  */
 
 #include <stdbool.h>
+#include <stdio.h>
 
 struct tbvm;
 typedef struct tbvm tbvm;
@@ -43,7 +44,8 @@ tbvm	*tbvm_alloc(void *);
 void	tbvm_exec(tbvm *);
 void	tbvm_free(tbvm *);
 
-void	tbvm_set_prog(tbvm *, const char *, size_t);
+bool	tbvm_set_prog(tbvm *, const char *, size_t);
+const char *tbvm_prog_error(tbvm *);
 
 #define	TBVM_EXC_DIV0		0x0001
 #define	TBVM_EXC_ARITH		0x0002
@@ -74,4 +76,51 @@ struct tbvm_exc_io {
 
 void	tbvm_set_exc_io(tbvm *, const struct tbvm_exc_io *);
 
+struct tbvm_trace_io {
+	void	(*io_trace_line)(void *, int);
+	void	(*io_trace_direct)(void *);
+	void	(*io_trace_gosub)(void *, int);
+	void	(*io_trace_return)(void *);
+	void	(*io_trace_gc)(void *, unsigned int);
+	void	(*io_trace_array)(void *, const char *, int);
+};
+
+void	tbvm_set_trace_io(tbvm *, const struct tbvm_trace_io *);
+
+bool	tbvm_profile_start(tbvm *);
+void	tbvm_profile_sample(tbvm *);
+void	tbvm_profile_dump(tbvm *, FILE *);
+
+#define	TBVM_PERF_CYCLES	0
+#define	TBVM_PERF_INSNS		1
+#define	TBVM_PERF_BRANCH_MISSES	2
+#define	TBVM_PERF_CACHE_MISSES	3
+#define	TBVM_PERF_NCOUNTERS	4
+
+struct tbvm_perf_io {
+	bool	(*io_perf_read)(void *, unsigned long long *);
+};
+
+bool	tbvm_set_perf_io(tbvm *, const struct tbvm_perf_io *, unsigned int);
+void	tbvm_perf_dump(tbvm *, FILE *);
+
+bool	tbvm_coverage_start(tbvm *);
+const unsigned long *tbvm_coverage(tbvm *, size_t *);
+
+struct tbvm_limits {
+	unsigned long	max_insns;	/* VM insns per command */
+	unsigned long	max_string_bytes; /* live string bytes */
+	unsigned long	max_array_elems; /* total array elements */
+	unsigned long	max_seconds;	/* wall-clock time per command */
+};
+
+#define	TBVM_LIMIT_NONE		0
+#define	TBVM_LIMIT_INSNS	1
+#define	TBVM_LIMIT_STRING_BYTES	2
+#define	TBVM_LIMIT_ARRAY_ELEMS	3
+#define	TBVM_LIMIT_SECONDS	4
+
+void	tbvm_set_limits(tbvm *, const struct tbvm_limits *);
+int	tbvm_limit_status(tbvm *);
+
 #endif /* tbvm_h_included */
@@ -122,19 +122,51 @@
 #define	OPC_ADVCRS	81
 #define	OPC_DEGRAD	82
 #define	OPC_UPRLWR	83
+#define	OPC_MEMO	84
+#define	OPC_CEXPR	85
+#define	OPC_DREAD	86
+#define	OPC_DSEEK	87
+#define	OPC_INSTR	88
+#define	OPC_HGET	89
+#define	OPC_HSET	90
+#define	OPC_HDEL	91
+#define	OPC_HINFO	92
 
-#define	OPC___LAST	OPC_UPRLWR
+#define	OPC___LAST	OPC_HINFO
 #define	OPC___COUNT	(OPC___LAST + 1)
 
 #define	OPC_F_LABEL	0x01
 #define	OPC_F_STRING	0x02
 #define	OPC_F_NUMBER	0x04
+#define	OPC_F_TERM	0x08	/* never falls through to the next insn */
 
 #define	OPC_NUM_SIZE	1
 #define	OPC_NUM_MIN	0
 #define	OPC_NUM_MAX	255
 
-#define	OPC_LBL_SIZE	2
+#define	OPC_LBL_SIZE	2		/* default */
+#define	OPC_LBL_SIZE_WIDE 4
+
+/*
+ * A VM program image starts with a header:
+ *
+ *	magic		4 bytes ("TBVM")
+ *	version		1 byte
+ *	label size	1 byte (OPC_LBL_SIZE or OPC_LBL_SIZE_WIDE)
+ *	reserved	2 bytes (0)
+ *
+ * VM program addresses are relative to the end of the header.  The
+ * collector and executor addresses follow the program.
+ */
+#define	OPC_HDR_MAGIC0	'T'
+#define	OPC_HDR_MAGIC1	'B'
+#define	OPC_HDR_MAGIC2	'V'
+#define	OPC_HDR_MAGIC3	'M'
+#define	OPC_HDR_VERSION	1
+#define	OPC_HDR_SIZE	8
+
+#define	OPC_HDR_OFF_VERSION	4
+#define	OPC_HDR_OFF_LBL_SIZE	5
 
 #define	OPC_LBL_ABS	1
 #define	OPC_LBL_REL	0
@@ -147,6 +147,23 @@
 ;     a string to all-upper-case or all-lower-case, respectively, using
 ;     the new UPRLWR VM insn.
 ;
+; ==> The statement keyword and function name TST chains are memoized
+;     per line and cursor position, by XINIT and the new MEMO VM insn,
+;     respectively.
+;
+; ==> Expressions in stored lines are compiled on first evaluation, using
+;     the new CEXPR VM insn.
+;
+; ==> READ takes DATA items from an index of the program's DATA
+;     statements using the new DREAD VM insn, and RESTORE accepts an
+;     optional line number using the new DSEEK VM insn.
+;
+; ==> Added the INSTR() function using the new INSTR VM insn.
+;
+; ==> Added associative arrays (var[key]), the DELETE statement, and
+;     the COUNT(), KEY$(), and EXISTS() functions using the new HGET,
+;     HSET, HDEL, and HINFO VM insns.
+;
 ; Original Tiny BASIC VM opcodes that are no longer used:
 ; ==> CMPR (replaced by CMPRX)
 ; ==> LST (replaced by LSTX)
@@ -178,9 +195,19 @@ STMT:	XINIT			; Initialize for a statement.
 
 	;
 	; LET var = expression
+	; LET var [ expression ] = expression
 	;
 	TST	notLET,'LET'	; LET statement?
-	CALL	ReqVarOrArray
+LET1:	TSTV	Serr		; Var required, error if not present.
+	TST	LET2,'['	; Dictionary element?
+	CALL	EXPR		; Yes, get the key.
+	TST	Serr,']'
+	TST	Serr,'='
+	CALL	EXPR		; Place expression value on AESTK
+	DONE			; End of statement.
+	HSET			; Store result in dictionary element.
+	NXT			; Next statement.
+LET2:	CALL	ARRAY		; Maybe index array.
 isLET:	TST	Serr,'='
 	CALL	EXPR		; Place expression value on AESTK
 	DONE			; End of statement.
@@ -411,28 +438,22 @@ notREM:
 	;
 	TST	notREAD,'READ'	; READ statement?
 RD1:	CALL	ReqVarOrArray
-	DMODE	1		; Goto into DATA mode.
-	TSTSOL	RD3		; At start-of-line?
-RD2:	TST	RDnxt,'DATA'	; Yes, DATA statement?
-RDstor:	DSTORE			; Yes, store data in var.
-	DMODE	0		; Exit data mode.
+	DREAD			; Store next DATA item in var.
 	TST	RDDone,','	; More vars?
 	JMP	RD1		; Yes, to get them.
-RD3:	TST	RD4,','		; Separator?
-	JMP	RDstor		; Yes, go store data.
-RD4:	TSTEOL	Serr		; If not end-of-line, syntax error.
-RDnxt:	NXTLN	RDDerr		; Advance to next line, if available.
-	JMP	RD2		; Try again.
-RDDerr:	DMODE	2		; Out of data error.
 RDDone:	DONEM	0		; End of statement (RUN-mode).
 	NXT			; Next statement.
 notREAD:
 
 	;
-	; RESTORE
+	; RESTORE [line-number]
 	;
 	TST	notRSTR,'RESTORE' ; RESTORE statement?
-	DONEM	0		; End of statement (RUN-mode).
+	TSTN	RS1		; Line number?
+	DONEM	0		; Yes, end of statement (RUN-mode).
+	DSEEK			; Set data pointer to that line.
+	NXT			; Next statement.
+RS1:	DONEM	0		; End of statement (RUN-mode).
 	DMODE	3		; Restore data pointer.
 	NXT			; Next statement.
 notRSTR:
@@ -541,6 +562,23 @@ DIM3:	DONE			; End of statement.
 	NXT			; Next statement.
 notDIM:
 
+	;
+	; DELETE var [ expression ]
+	; DELETE var
+	;
+	TST	notDELETE,'DELETE' ; DELETE statement?
+	TSTV	Serr		; Get naming var.
+	TST	DEL1,'['	; Single element?
+	CALL	EXPR		; Yes, get the key.
+	TST	Serr,']'
+	DONE			; End of statement.
+	HDEL	0		; mode 0 -> delete element
+	NXT			; Next statement.
+DEL1:	DONE			; End of statement.
+	HDEL	1		; mode 1 -> delete all elements
+	NXT			; Next statement.
+notDELETE:
+
 	;
 	; LOAD "characterstring"
 	;
@@ -597,8 +635,7 @@ notSRND:
 	; This is to match the extremely-common-among-BASICs behavior
 	; of allowing variable assignments without LET.
 	;
-	CALL	ReqVarOrArray	; Check for a var or array.
-	JMP	isLET		; ...and try to match an assignment.
+	JMP	LET1		; Check for a var and match an assignment.
 
 Serr:	ERR			; Syntax error.
 
@@ -654,20 +691,34 @@ Serr:	ERR			; Syntax error.
 ;              LEFT$ ( expression , expression )
 ;              UCASE$ ( expression )
 ;              LCASE$ ( expression )
+;              INSTR ( instr-opt-start expression , expression )
+;              COUNT ( var )
+;              KEY$ ( var , expression )
+;              EXISTS ( var [ expression ] )
 ;
 ; mid-opt-len ::=
 ;                 , expression
 ;
+; instr-opt-start ::=
+;                     expression ,
+;
 ; reserved-const ::= PI
 ;
 ; var ::= A | B | ... | Y | Z
+;         var ( expression opt-dim )
+;         var [ expression ]
 ;
 ; number ::= digit
 ;            digit number
 ;
 ; digit ::= 0 | 1 | 2  | ...  | 8 | 9
 ;
-EXPR:	TST	E0,'-'		; Unary -?
+	;
+	; If this expression has been evaluated before, CEXPR runs the
+	; compiled form and returns from EXPR.
+	;
+EXPR:	CEXPR
+	TST	E0,'-'		; Unary -?
 	CALL	TERM		; Yes, get first term.
 	NEG			; Negate it.
 	JMP	E1
@@ -718,8 +769,12 @@ T3:	TST	T4,'%'		; Modulus?
 FACT:
 	;
 	; We have to check for functions first, because the first
-	; letter of a function name would match a variable.
+	; letter of a function name would match a variable.  The
+	; outcome of the chain of TSTs is remembered for each position
+	; in a stored line, so that variable references don't pay for
+	; it every time.
 	;
+	MEMO
 	TST	notRND,'RND'	; RND() function?
 	CALL	FUNC1ARG
 	RND
@@ -924,6 +979,50 @@ notUCASE:
 	RTN
 notLCASE:
 
+	TST	notINSTR,'INSTR' ; INSTR() function?
+	TST	Serr,'('
+	CALL	EXPR		; First argument is start or string expression.
+	TST	Serr,','
+	CALL	EXPR		; Second argument is string expression.
+	TST	INS1,','	; Third argument?
+	CALL	EXPR		; Yes, and it's a string expression.
+	LIT	1		; 3 args == INSTR mode 1.
+	JMP	INS2		; Go do it.
+INS1:	LIT	0		; 2 args == INSTR mode 0.
+INS2:	TST	Serr,')'
+	INSTR
+	RTN
+notINSTR:
+
+	TST	notCOUNT,'COUNT' ; COUNT() function?
+	TST	Serr,'('
+	TSTV	Serr		; Get naming var.
+	TST	Serr,')'
+	HINFO	0		; mode 0 -> element count
+	RTN
+notCOUNT:
+
+	TST	notKEY,'KEY$'	; KEY$() function?
+	TST	Serr,'('
+	TSTV	Serr		; Get naming var.
+	TST	Serr,','
+	CALL	EXPR		; Second argument is numeric expression.
+	TST	Serr,')'
+	HINFO	1		; mode 1 -> Nth key
+	RTN
+notKEY:
+
+	TST	notEXISTS,'EXISTS' ; EXISTS() function?
+	TST	Serr,'('
+	TSTV	Serr		; Get naming var.
+	TST	Serr,'['
+	CALL	EXPR		; Get the key.
+	TST	Serr,']'
+	TST	Serr,')'
+	HGET	1		; mode 1 -> element exists
+	RTN
+notEXISTS:
+
 	;
 	; Check for reserved constants before variables, because
 	; these reserved names may otherwise collide with var
@@ -936,8 +1035,13 @@ notLCASE:
 notPi:
 
 	TSTV	F0		; Variable?
-	CALL	ARRAY		; Maybe index array.
-	IND			; Yes, get the value.
+	TST	FD1,'['		; Yes, dictionary element?
+	CALL	EXPR		; Yes, get the key.
+	TST	Serr,']'
+	HGET	0		; mode 0 -> get the value
+	RTN
+FD1:	CALL	ARRAY		; Maybe index array.
+	IND			; Get the value.
 	RTN
 
 F0:	TSTS	F1		; String?  Push it onto the stack.